@@ -0,0 +1,68 @@
+-- cffi-lua benchmark helpers
+-- used by the individual benchmark scripts
+
+local M = {}
+
+-- the number of iterations can be scaled through the environment
+local scale = tonumber(os.getenv("BENCH_SCALE") or "") or 1
+
+local clock = os.clock
+
+-- the number of times each benchmark is repeated; the best time is taken
+local repeats = 5
+
+-- runs fn(n) which is expected to perform n iterations of the benchmarked
+-- operation, and reports the time taken per iteration; when every iteration
+-- goes over `per` items, such as the elements of an array, it is per item
+M.run = function(name, n, fn, per)
+    n = math.max(math.floor(n * scale), 1)
+    -- warm up
+    fn(math.floor(n / 10) + 1)
+    local best
+    for i = 1, repeats do
+        collectgarbage()
+        collectgarbage()
+        local t = clock()
+        fn(n)
+        t = clock() - t
+        if not best or (t < best) then
+            best = t
+        end
+    end
+    local items = n * (per or 1)
+    io.write(("%-48s %10.1f ns/op\n"):format(name, best * 1e9 / items))
+    return best
+end
+
+-- runs fn() once, for operations that cannot be repeated, and reports the
+-- time taken per each of the n items it processes
+M.once = function(name, n, fn)
+    collectgarbage()
+    collectgarbage()
+    local t = clock()
+    fn()
+    t = clock() - t
+    io.write(("%-48s %10.1f ns/op\n"):format(name, t * 1e9 / n))
+    return t
+end
+
+-- runs fn(n) with the collector stopped and reports the number of bytes
+-- allocated per iteration, i.e. the work left for the garbage collector
+M.alloc = function(name, n, fn)
+    n = math.floor(n * scale)
+    collectgarbage()
+    collectgarbage()
+    collectgarbage("stop")
+    local m = collectgarbage("count")
+    fn(n)
+    m = collectgarbage("count") - m
+    collectgarbage("restart")
+    io.write(("%-48s %10.1f B/op\n"):format(name, m * 1024 / n))
+    return m
+end
+
+M.header = function(name)
+    io.write(("%s (%s)\n"):format(name, _VERSION))
+end
+
+return M
@@ -0,0 +1,70 @@
+-- direct call trampolines versus the generic libffi call path
+--
+-- the same C functions are declared twice; the second declaration has an
+-- explicit calling convention, which always makes calls go through libffi
+
+local ffi = require("cffi")
+local bench = require("bench")
+
+ffi.cdef [[
+    int abs(int v);
+    long labs(long v);
+    double fmax(double a, double b);
+
+    int abs_ffi(int v) __attribute__((cdecl)) __asm__("abs");
+    long labs_ffi(long v) __attribute__((cdecl)) __asm__("labs");
+    double fmax_ffi(double a, double b) __attribute__((cdecl)) __asm__("fmax");
+]]
+
+local C = ffi.C
+local N = 2000000
+
+bench.header("function calls")
+
+local abs, abs_ffi = C.abs, C.abs_ffi
+bench.run("int(int), direct", N, function(n)
+    for i = 1, n do abs(-i) end
+end)
+bench.run("int(int), libffi", N, function(n)
+    for i = 1, n do abs_ffi(-i) end
+end)
+
+local labs, labs_ffi = C.labs, C.labs_ffi
+bench.run("long(long), direct", N, function(n)
+    for i = 1, n do labs(-i) end
+end)
+bench.run("long(long), libffi", N, function(n)
+    for i = 1, n do labs_ffi(-i) end
+end)
+
+local fmax, fmax_ffi = C.fmax, C.fmax_ffi
+bench.run("double(double, double), direct", N, function(n)
+    for i = 1, n do fmax(i, 0.5) end
+end)
+bench.run("double(double, double), libffi", N, function(n)
+    for i = 1, n do fmax_ffi(i, 0.5) end
+end)
+
+-- results must match either way
+assert(abs(-5) == abs_ffi(-5))
+assert(fmax(1.5, 0.5) == fmax_ffi(1.5, 0.5))
+
+-- variadic calls; the prepared cif is reused for repeated argument shapes
+ffi.cdef [[
+    int snprintf(char *buf, size_t n, char const *fmt, ...);
+]]
+
+local snprintf = C.snprintf
+local buf = ffi.new("char[64]")
+local bufp = ffi.cast("char *", buf)
+bench.run("snprintf, one shape", N / 4, function(n)
+    for i = 1, n do snprintf(bufp, 64, "%s", "x") end
+end)
+bench.run("snprintf, alternating shapes", N / 4, function(n)
+    for i = 1, n, 2 do
+        snprintf(bufp, 64, "%s", "x")
+        snprintf(bufp, 64, "%g %s", 0.5, "x")
+    end
+end)
+assert(snprintf(bufp, 64, "%g %s", 0.5, "x") == 5)
+assert(ffi.string(buf) == "0.5 x")
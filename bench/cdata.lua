@@ -0,0 +1,69 @@
+-- memory footprint and allocation cost of boxed cdata of various types,
+-- i.e. the per-object overhead of the cdata header
+
+local ffi = require("cffi")
+local bench = require("bench")
+
+local N = 100000
+
+bench.header("cdata footprint")
+
+ffi.cdef [[
+    struct bench_pt {
+        int x, y;
+    };
+]]
+
+local types = {
+    "int", "double", "int64_t", "void *", "struct bench_pt", "int[4]",
+    "long double",
+}
+
+for i, tp in ipairs(types) do
+    local ct = ffi.typeof(tp)
+    bench.alloc(("ffi.new(\"%s\")"):format(tp), N, function(n)
+        for j = 1, n do local v = ffi.new(ct) end
+    end)
+end
+
+local x = ffi.new("struct bench_pt[16]")
+bench.alloc("pointer arithmetic", N, function(n)
+    for j = 1, n do local v = x + (j % 16) end
+end)
+
+bench.run("ffi.new(\"struct bench_pt\")", N, function(n)
+    local ct = ffi.typeof("struct bench_pt")
+    for j = 1, n do local v = ffi.new(ct) end
+end)
+
+-- request-scoped scratch buffers, through the collector and from an arena
+local ar = ffi.arena()
+local function scratch_new(n)
+    for j = 1, n do local v = ffi.new("char[?]", 256) end
+end
+local function scratch_arena(n)
+    for j = 1, n do
+        local v = ar:new("char[?]", 256)
+        if (j % 100) == 0 then ar:reset() end
+    end
+end
+
+bench.alloc("ffi.new(\"char[?]\", 256)", N, scratch_new)
+bench.alloc("arena:new(\"char[?]\", 256)", N, scratch_arena)
+bench.run("ffi.new(\"char[?]\", 256)", N, scratch_new)
+bench.run("arena:new(\"char[?]\", 256)", N, scratch_arena)
+
+-- the arena pays off once the values are large enough that the collector
+-- work on their memory outweighs the extra cost of the call
+local function big_new(n)
+    for j = 1, n do local v = ffi.new("char[?]", 4096) end
+end
+local function big_arena(n)
+    for j = 1, n do
+        local v = ar:new("char[?]", 4096)
+        if (j % 100) == 0 then ar:reset() end
+    end
+end
+
+bench.run("ffi.new(\"char[?]\", 4096)", N, big_new)
+bench.run("arena:new(\"char[?]\", 4096)", N, big_arena)
@@ -0,0 +1,76 @@
+-- declaration store scaling: a large number of declarations is defined
+-- and then looked up again by name
+
+local ffi = require("cffi")
+local bench = require("bench")
+
+local ND = 50000
+local N = 200000
+
+bench.header("declaration store")
+
+local decls = {}
+for i = 1, ND do
+    decls[#decls + 1] = ("typedef int bdecl_%d;"):format(i)
+end
+local tdefs = table.concat(decls, "\n")
+
+decls = {}
+for i = 1, ND do
+    decls[#decls + 1] = ("int bdecl_fn_%d(bdecl_%d a);"):format(i, i)
+end
+local fdecls = table.concat(decls, "\n")
+decls = nil
+
+bench.once(("cdef, %d typedefs"):format(ND), ND, function()
+    ffi.cdef(tdefs)
+end)
+bench.once(("cdef, %d functions using them"):format(ND), ND, function()
+    ffi.cdef(fdecls)
+end)
+
+-- distinct names, so that the lookups are not served by the type cache
+local names = {}
+for i = 1, ND do
+    names[i] = "bdecl_" .. i
+end
+bench.run("sizeof of a declared type name", N, function(n)
+    local sizeof = ffi.sizeof
+    for i = 1, n do sizeof(names[i % ND + 1]) end
+end)
+
+-- the same header through the parser and as a precompiled image
+local function header(pfx)
+    local hdr = {}
+    for i = 1, ND / 5 do
+        hdr[#hdr + 1] = ([[
+            typedef struct %s_s%d { int a; double b; char c[16]; } %s_t%d;
+            %s_t%d *%s_f%d(%s_t%d const *p, unsigned long n);
+        ]]):format(pfx, i, pfx, i, pfx, i, pfx, i, pfx, i)
+    end
+    return table.concat(hdr)
+end
+local hdr_parse, hdr_image = header("bhp"), header("bhi")
+
+bench.once(("cdef, %d declarations"):format(ND / 5 * 3), ND / 5 * 3, function()
+    ffi.cdef(hdr_parse)
+end)
+local img = ffi.dump_image(hdr_image)
+bench.once(("cdef_image, %d declarations"):format(ND / 5 * 3), ND / 5 * 3,
+function()
+    ffi.cdef_image(img)
+end)
+assert(ffi.sizeof("bhi_t1") == ffi.sizeof("bhp_t1"))
+
+-- small definitions into the already large store
+local ncdef = 0
+bench.run("one-line cdef", N / 4, function(n)
+    local cdef = ffi.cdef
+    for i = 1, n do
+        ncdef = ncdef + 1
+        cdef("typedef int bsmall_" .. ncdef .. ";")
+    end
+end)
+
+assert(ffi.sizeof("bdecl_" .. ND) == ffi.sizeof("int"))
+assert(ffi.sizeof("bsmall_" .. ncdef) == ffi.sizeof("int"))
@@ -0,0 +1,59 @@
+-- pointers and references created by field and element accesses
+
+local ffi = require("cffi")
+local bench = require("bench")
+
+local NE = 1000000
+local N = 2000000
+
+bench.header("field access")
+
+ffi.cdef [[
+    struct bench_node {
+        struct bench_node *next;
+        int v;
+    };
+]]
+
+local nodes = ffi.new("struct bench_node[?]", NE)
+for i = 0, NE - 2 do
+    nodes[i].next = nodes + (i + 1)
+    nodes[i].v = i
+end
+
+local nullptr = ffi.nullptr
+local function walk(n)
+    local p = nodes + 0
+    for i = 1, n do
+        p = p.next
+        if p == nullptr then p = nodes + 0 end
+    end
+end
+local function elems(n)
+    for i = 1, n do local e = nodes[i % NE] end
+end
+
+bench.run("linked list walk", N, walk)
+bench.alloc("linked list walk", N / 10, walk)
+bench.run("struct array element reference", N, elems)
+bench.run("scalar field read", N, function(n)
+    local s = nodes[0]
+    for i = 1, n do local v = s.v end
+end)
+
+-- identity caches keyed by pointers read from C memory
+
+local cache = {}
+for i = 0, 99 do
+    cache[ffi.key(nodes + i)] = i
+end
+bench.run("pointer cache lookup, cffi.key", N, function(n)
+    local p = nodes[5].next
+    for i = 1, n do local v = cache[ffi.key(p)] end
+end)
+bench.run("pointer cache lookup, tonumber(cast)", N, function(n)
+    local p = nodes[5].next
+    for i = 1, n do
+        local v = cache[ffi.tonumber(ffi.cast("uintptr_t", p))]
+    end
+end)
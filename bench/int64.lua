@@ -0,0 +1,70 @@
+-- reading 64-bit integers, boxed into cdata by default on Lua 5.1 and 5.2
+-- and returned as plain numbers when unboxing is enabled
+
+local ffi = require("cffi")
+local bench = require("bench")
+
+local N = 1000000
+local NE = 1000
+
+bench.header("64-bit integers")
+
+ffi.cdef [[
+    struct bench_u64 {
+        uint64_t u;
+        int64_t i;
+    };
+]]
+
+local s = ffi.new("struct bench_u64", { 12345, -12345 })
+local arr = ffi.new("uint64_t[?]", NE)
+for i = 0, NE - 1 do arr[i] = i end
+
+local function field(n)
+    for i = 1, n do local v = s.u end
+end
+local function elems(n)
+    for i = 1, n do
+        for j = 0, NE - 1 do local v = arr[j] end
+    end
+end
+
+for _, unbox in ipairs({ false, true }) do
+    ffi.unbox64(unbox)
+    local mode = unbox and "unboxed" or "boxed"
+    bench.run(("uint64_t field read, %s"):format(mode), N, field)
+    bench.alloc(("uint64_t field read, %s"):format(mode), N / 10, field)
+    bench.run(("uint64_t array loop, %s"):format(mode), N / NE, elems, NE)
+end
+ffi.unbox64(false)
+
+-- arithmetic on 64-bit cdata, as in counters and hashes
+
+local one = ffi.new("uint64_t", 1)
+local prime = ffi.new("uint64_t", 1099511628211)
+
+local function counter(n)
+    local acc = ffi.new("uint64_t", 0)
+    for i = 1, n do acc = acc + one end
+end
+local function icounter(n)
+    local acc = ffi.new("uint64_t", 0)
+    for i = 1, n do ffi.iadd(acc, one) end
+end
+
+bench.run("uint64_t counter (acc + 1)", N, counter)
+bench.alloc("uint64_t counter (acc + 1)", N / 10, counter)
+bench.run("uint64_t counter (cffi.iadd)", N, icounter)
+bench.alloc("uint64_t counter (cffi.iadd)", N / 10, icounter)
+bench.run("uint64_t multiply (acc * prime)", N, function(n)
+    local acc = ffi.new("uint64_t", 12345)
+    for i = 1, n do acc = acc * prime end
+end)
+bench.run("uint64_t multiply (cffi.imul)", N, function(n)
+    local acc = ffi.new("uint64_t", 12345)
+    for i = 1, n do ffi.imul(acc, prime) end
+end)
+bench.run("int64_t compare (a < b)", N, function(n)
+    local a, b = ffi.new("int64_t", 1), ffi.new("int64_t", 2)
+    for i = 1, n do local v = a < b end
+end)
@@ -0,0 +1,37 @@
+-- metatype dispatch: methods through __index, arithmetic metamethods
+
+local ffi = require("cffi")
+local bench = require("bench")
+
+ffi.cdef [[
+    struct bvec {
+        double x, y;
+    };
+]]
+
+local vec
+vec = ffi.metatype("struct bvec", {
+    __index = {
+        dot = function(a, b)
+            return a.x * b.x + a.y * b.y
+        end
+    },
+    __add = function(a, b)
+        return vec(a.x + b.x, a.y + b.y)
+    end
+})
+
+local N = 1000000
+
+bench.header("metatype dispatch")
+
+local a, b = vec(1, 2), vec(3, 4)
+bench.run("method call through __index", N, function(n)
+    for i = 1, n do a:dot(b) end
+end)
+bench.run("__add metamethod", N, function(n)
+    for i = 1, n do local c = a + b end
+end)
+
+assert(a:dot(b) == 11)
+assert((a + b).y == 6)
@@ -0,0 +1,25 @@
+-- C buffers to Lua strings, copied versus owned (zero-copy on 5.5)
+
+local ffi = require("cffi")
+local bench = require("bench")
+
+local N = 200000
+
+bench.header("strings")
+
+for _, sz in ipairs({256, 65536}) do
+    local buf = ffi.new("char[?]", sz + 1)
+    ffi.fill(buf, sz, 0x61)
+    bench.run(sz .. " bytes, copied", N, function(n)
+        for i = 1, n do local s = ffi.string(buf, sz) end
+    end)
+    bench.run(sz .. " bytes, owned", N, function(n)
+        for i = 1, n do local s = ffi.string(buf, sz, buf) end
+    end)
+    -- what C libraries hand out, with the caller vouching for the zero
+    local ptr = ffi.cast("char *", buf)
+    bench.run(sz .. " bytes, owned pointer", N, function(n)
+        for i = 1, n do local s = ffi.string(ptr, sz, buf, true) end
+    end)
+    assert(ffi.string(buf, sz, buf) == ("a"):rep(sz))
+end
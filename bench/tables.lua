@@ -0,0 +1,55 @@
+-- conversion of Lua tables into C arrays, reported per element
+
+local ffi = require("cffi")
+local bench = require("bench")
+
+local NE = 1000000
+local N = 10
+
+bench.header("table conversion")
+
+local nums, ints = {}, {}
+for i = 1, NE do
+    nums[i] = i * 0.5
+    ints[i] = i
+end
+
+bench.run(("new double[?] from %d numbers"):format(NE), N, function(n)
+    for i = 1, n do ffi.new("double[?]", NE, nums) end
+end, NE)
+bench.run(("new int32_t[?] from %d integers"):format(NE), N, function(n)
+    for i = 1, n do ffi.new("int32_t[?]", NE, ints) end
+end, NE)
+
+local buf = ffi.new("double[?]", NE)
+bench.run(("fromtable into double[%d]"):format(NE), N, function(n)
+    for i = 1, n do ffi.fromtable(buf, nums) end
+end, NE)
+bench.run(("element-wise store into double[%d]"):format(NE), N, function(n)
+    for i = 1, n do
+        for j = 1, NE do buf[j - 1] = nums[j] end
+    end
+end, NE)
+
+bench.run(("totable of double[%d]"):format(NE), N, function(n)
+    for i = 1, n do ffi.totable(buf, NE) end
+end, NE)
+bench.run(("element-wise load from double[%d]"):format(NE), N, function(n)
+    for i = 1, n do
+        local t = {}
+        for j = 1, NE do t[j] = buf[j - 1] end
+    end
+end, NE)
+
+bench.run(("indexed sum of double[%d]"):format(NE), N, function(n)
+    for i = 1, n do
+        local s = 0
+        for j = 0, NE - 1 do s = s + buf[j] end
+    end
+end, NE)
+bench.run(("ipairs sum of double[%d]"):format(NE), N, function(n)
+    for i = 1, n do
+        local s = 0
+        for j, v in ffi.ipairs(buf) do s = s + v end
+    end
+end, NE)
@@ -1,5 +1,6 @@
 #include <cassert>
 #include <cstdint>
+#include <atomic>
 
 #include "platform.hh"
 #include "util.hh"
@@ -669,6 +670,9 @@ void c_function::do_serialize(
 }
 
 void c_type::clear() {
+    if ((p_flags & C_TYPE_SHARED) && p_iref) {
+        p_iref->release();
+    }
     int tp = type();
     if (tp == C_BUILTIN_FUNC) {
         using T = util::rc_obj<c_function>;
@@ -682,7 +686,9 @@ void c_type::clear() {
 void c_type::copy(c_type const &v) {
     p_asize = v.p_asize;
     p_ttype = v.p_ttype;
-    p_flags = v.p_flags;
+    p_flags = v.p_flags & ~std::uint32_t(
+        C_TYPE_INTERNED | C_TYPE_UNIQUE | C_TYPE_SHARED
+    );
     p_cv = v.p_cv;
 
     int tp = type();
@@ -955,6 +961,17 @@ std::size_t c_type::alloc_size() const {
 bool c_type::is_same(
     c_type const &other, bool ignore_cv, bool ignore_ref
 ) const {
+    if (this == &other) {
+        return true;
+    }
+    /* unique instances are not equal to any other type, interned or not,
+     * unless some of the qualification is ignored
+     */
+    if (
+        (p_flags & other.p_flags & C_TYPE_UNIQUE) && !ignore_cv && !ignore_ref
+    ) {
+        return false;
+    }
     if (!ignore_cv && (cv() != other.cv())) {
         return false;
     }
@@ -1038,7 +1055,7 @@ bool c_function::is_same(c_function const &other) const {
     if (!p_result.is_same(other.p_result)) {
         return false;
     }
-    if (p_variadic != other.p_variadic) {
+    if (variadic() != other.variadic()) {
         return false;
     }
     if (p_params.size() != other.p_params.size()) {
@@ -1057,20 +1074,76 @@ bool c_record::is_same(c_record const &other) const {
 }
 
 std::ptrdiff_t c_record::field_offset(
-    char const *fname, c_type const *&fld
+    char const *fname, std::size_t nlen, c_type const *&fld, decl_store *ds
 ) const {
-    std::ptrdiff_t ret = -1;
-    iter_fields([fname, &ret, &fld](
-        char const *ffname, ast::c_type const &ffld, std::size_t off
+    if (!p_index) {
+        return -1;
+    }
+    auto h = util::str_hash{}(fname, nlen);
+    for (std::size_t i = h & p_imask;; i = (i + 1) & p_imask) {
+        auto &ent = p_index[i];
+        if (!ent.name) {
+            return -1;
+        }
+        if (
+            (ent.hash == h) && (ent.nlen == nlen) &&
+            !std::memcmp(ent.name, fname, nlen)
+        ) {
+            if (ds && !ent.type->interned()) {
+                ent.type = &ds->intern(*ent.type);
+            }
+            fld = ent.type;
+            return std::ptrdiff_t(ent.off);
+        }
+    }
+    /* unreachable, the index is never full */
+    return -1;
+}
+
+/* the index is an open addressing table with linear probing, populated
+ * through iter_fields so that the offsets and the handling of transparent
+ * members and flexible arrays are exactly the same; it is kept at most
+ * half full, and on duplicate names the first field wins like before
+ */
+void c_record::build_index() {
+    std::size_t nflds = 0;
+    iter_fields([&nflds](char const *, ast::c_type const &, std::size_t) {
+        ++nflds;
+        return false;
+    });
+    if (!nflds) {
+        return;
+    }
+    std::size_t isz = 4;
+    while (isz < (nflds * 2)) {
+        isz *= 2;
+    }
+    p_index = new field_entry[isz];
+    p_imask = isz - 1;
+    for (std::size_t i = 0; i < isz; ++i) {
+        p_index[i].name = nullptr;
+    }
+    iter_fields([this](
+        char const *fname, ast::c_type const &ffld, std::size_t off
     ) {
-        if (!std::strcmp(fname, ffname)) {
-            ret = std::ptrdiff_t(off);
-            fld = &ffld;
-            return true;
+        auto nlen = std::strlen(fname);
+        auto h = util::str_hash{}(fname, nlen);
+        for (std::size_t i = h & p_imask;; i = (i + 1) & p_imask) {
+            auto &ent = p_index[i];
+            if (!ent.name) {
+                ent.name = fname;
+                ent.nlen = nlen;
+                ent.hash = h;
+                ent.off = off;
+                ent.type = &ffld;
+                break;
+            }
+            if ((ent.nlen == nlen) && !std::memcmp(ent.name, fname, nlen)) {
+                break;
+            }
         }
         return false;
     });
-    return ret;
 }
 
 static inline ffi_type *libffi_base(ast::c_type const &tp, std::size_t &asz) {
@@ -1107,7 +1180,9 @@ std::size_t c_record::iter_fields(bool (*cb)(
         if (p_fields[i].name.empty()) {
             /* transparent record is like a real member */
             assert(p_fields[i].type.type() == ast::C_BUILTIN_RECORD);
-            p_fields[i].type.record().iter_fields(cb, data, base, end);
+            p_fields[i].type.record().iter_fields(
+                cb, data, obase + base, end
+            );
             if (end) {
                 return base;
             }
@@ -1281,6 +1356,11 @@ void c_record::set_fields(util::vector<field> fields) {
 
     p_fields = util::move(fields);
 
+    set_layout();
+    build_index();
+}
+
+void c_record::set_layout() {
     /* unions are handled specially; they are a struct that is filled
      * to the correct size and with correct types to satisfy ABI (when
      * passing is allowed); alignment is handled manually
@@ -1412,20 +1492,38 @@ c_object const *decl_store::add(c_object *decl) {
 void decl_store::commit() {
     /* this should only ever be used when staging */
     assert(p_base);
-    /* reserve all space at once */
-    p_base->p_dlist.reserve(p_base->p_dlist.size() + p_dlist.size());
-    /* move all */
+    /* move all and set up mappings in base; every staged object has its
+     * own mapping, so this is proportional to the number of new objects
+     */
     for (std::size_t i = 0; i < p_dlist.size(); ++i) {
+        auto *d = p_dlist[i].value;
         p_base->p_dlist.push_back(util::move(p_dlist[i]));
+        p_base->p_dmap.insert(d->name(), d);
+        p_base->declare(*d);
     }
-    /* set up mappings in base */
-    p_dmap.for_each([this](char const *key, c_object *value) {
-        p_base->p_dmap.insert(key, value);
-    });
     p_base->name_counter += name_counter;
     drop();
 }
 
+/* lua states may be used from different threads */
+static std::atomic<std::size_t> ptr_intern_states{0};
+
+void decl_store::set_ptr_intern(bool v) {
+    if (v == p_ptr_intern) {
+        return;
+    }
+    p_ptr_intern = v;
+    if (v) {
+        ++ptr_intern_states;
+    } else {
+        --ptr_intern_states;
+    }
+}
+
+bool decl_store::ptr_intern_any() {
+    return ptr_intern_states.load(std::memory_order_relaxed) != 0;
+}
+
 void decl_store::drop() {
     p_dmap.clear();
     p_dlist.clear();
@@ -1463,15 +1561,240 @@ std::size_t decl_store::request_name(char *buf, std::size_t bufsize) {
     return util::write_u(buf, bufsize, n);
 }
 
-c_type from_lua_type(lua_State *L, int index) {
+c_type const &decl_store::intern(c_type const &tp) {
+    if (tp.interned()) {
+        return tp;
+    }
+    if (p_base) {
+        return p_base->intern(tp);
+    }
+    return *p_types[intern_idx(tp)];
+}
+
+bool decl_store::func_equal::operator()(
+    func_key const &k1, func_key const &k2
+) const {
+    return (
+        (k1.func->flags() == k2.func->flags()) && k1.func->is_same(*k2.func)
+    );
+}
+
+std::size_t decl_store::intern_func(util::rc_obj<c_function> const &func) {
+    func_key key;
+    key.func = func.get();
+    key.hash = std::size_t(func->flags());
+    auto mix = [&key](void const *p) {
+        key.hash = (key.hash * 31) ^ std::size_t(util::pun<std::uintptr_t>(p));
+    };
+    mix(&intern(func->result()));
+    auto &params = func->params();
+    for (std::size_t i = 0; i < params.size(); ++i) {
+        mix(&intern(params[i].type()));
+    }
+    auto *idx = p_fmap.find(key);
+    if (idx) {
+        return *idx;
+    }
+    p_funcs.push_back(func);
+    return p_fmap.insert(key, p_funcs.size() - 1);
+}
+
+/* whether the type is built from a sized array, see find */
+static bool transient(c_type const &tp) {
+    for (auto *p = &tp;; p = &p->ptr_base()) {
+        switch (p->type()) {
+            case C_BUILTIN_ARRAY:
+                if (!p->flex()) {
+                    return true;
+                }
+                break;
+            case C_BUILTIN_PTR:
+                break;
+            default:
+                return false;
+        }
+    }
+}
+
+/* named types are interned even if they are transient, as their number
+ * is bounded by the declarations
+ */
+void decl_store::declare(c_object const &d) {
+    c_type const *tp;
+    switch (d.obj_type()) {
+        case c_object_type::TYPEDEF:
+            tp = &d.as<c_typedef>().type();
+            break;
+        case c_object_type::VARIABLE:
+            tp = &d.as<c_variable>().type();
+            break;
+        default:
+            return;
+    }
+    if (transient(*tp)) {
+        intern(*tp);
+    }
+}
+
+c_type const &decl_store::find(c_type const &tp) {
+    if (tp.interned() || tp.shared()) {
+        return tp;
+    }
+    if (p_base) {
+        return p_base->find(tp);
+    }
+    if (!transient(tp)) {
+        return *p_types[intern_idx(tp)];
+    }
+    auto idx = find_idx(tp);
+    if (idx < p_types.size()) {
+        return *p_types[idx];
+    }
+    return share(tp);
+}
+
+/* the base is interned or shared as well, so that types derived from it,
+ * such as references to array elements, can be remembered by it
+ */
+c_type const &decl_store::share(c_type const &tp) {
+    auto *ret = util::rc_obj<c_type>::make_raw(tp.copy());
+    ret->p_flags |= C_TYPE_SHARED;
+    auto &base = *tp.p_ptr;
+    if (!base.interned() && !base.shared()) {
+        ret->p_ptr = util::rc_obj<c_type>{const_cast<c_type *>(&find(base))};
+    }
+    return *ret;
+}
+
+c_type const &decl_store::ref_to(c_type const &tp) {
+    if (tp.shared()) {
+        if (!tp.p_iref) {
+            auto &rtp = find(tp.as_ref());
+            rtp.acquire();
+            tp.p_iref = &rtp;
+        }
+        return *tp.p_iref;
+    }
+    if (!tp.interned() && transient(tp)) {
+        return find(tp.as_ref());
+    }
+    auto &itp = intern(tp);
+    if (!itp.p_iref) {
+        /* interned once, then remembered by the type */
+        itp.p_iref = &intern(itp.as_ref());
+    }
+    return *itp.p_iref;
+}
+
+c_type const &decl_store::ptr_to(c_type const &tp) {
+    if (p_base) {
+        return p_base->ptr_to(tp);
+    }
+    if (!tp.interned() && transient(tp)) {
+        return find(c_type{util::make_rc<c_type>(tp.copy()), 0, C_BUILTIN_PTR});
+    }
+    auto bidx = intern_idx(tp);
+    return *p_types[intern_idx(c_type{p_types[bidx], 0, C_BUILTIN_PTR})];
+}
+
+/* the key of a type whose base, if any, is interned at bidx; returns
+ * whether the type is unique
+ */
+bool decl_store::make_key(c_type const &tp, std::size_t bidx, type_key &key) {
+    key.asize = 0;
+    key.bits = tp.p_ttype | (tp.p_cv << 5) | (std::uint32_t(
+        tp.p_flags & ~std::uint32_t(
+            C_TYPE_INTERNED | C_TYPE_UNIQUE | C_TYPE_SHARED
+        )
+    ) << 7);
+    /* a unique type is not equal to any other interned type, which is not
+     * the case for function types, as a function is the same as a pointer
+     * to it, and for arrays with unknown size
+     */
+    bool uniq = true;
+    switch (tp.type()) {
+        case C_BUILTIN_PTR:
+        case C_BUILTIN_ARRAY:
+            key.ref = p_types[bidx].get();
+            if (tp.type() == C_BUILTIN_ARRAY) {
+                key.asize = tp.p_asize;
+                uniq = !tp.flex();
+            }
+            uniq = uniq && (p_types[bidx]->p_flags & C_TYPE_UNIQUE);
+            break;
+        case C_BUILTIN_FUNC:
+            key.ref = p_funcs[bidx].get();
+            uniq = false;
+            break;
+        case C_BUILTIN_RECORD:
+            key.ref = tp.p_crec;
+            break;
+        case C_BUILTIN_ENUM:
+            key.ref = tp.p_cenum;
+            break;
+        default:
+            key.ref = nullptr;
+            break;
+    }
+    return uniq;
+}
+
+/* the index of the interned instance of a transient type, without adding
+ * anything; not found is an index past the end
+ */
+std::size_t decl_store::find_idx(c_type const &tp) {
+    if (!transient(tp)) {
+        return intern_idx(tp);
+    }
+    auto bidx = find_idx(*tp.p_ptr);
+    if (bidx >= p_types.size()) {
+        return bidx;
+    }
+    type_key key;
+    make_key(tp, bidx, key);
+    auto *idx = p_tmap.find(key);
+    return idx ? *idx : p_types.size();
+}
+
+std::size_t decl_store::intern_idx(c_type const &tp) {
+    std::size_t bidx = 0;
+    switch (tp.type()) {
+        case C_BUILTIN_PTR:
+        case C_BUILTIN_ARRAY:
+            bidx = intern_idx(*tp.p_ptr);
+            break;
+        case C_BUILTIN_FUNC:
+            bidx = intern_func(tp.p_func);
+            break;
+        default:
+            break;
+    }
+    type_key key;
+    bool uniq = make_key(tp, bidx, key);
+    auto *idx = p_tmap.find(key);
+    if (idx) {
+        return *idx;
+    }
+    c_type ntp{};
+    ntp.copy(tp);
+    if ((tp.type() == C_BUILTIN_PTR) || (tp.type() == C_BUILTIN_ARRAY)) {
+        /* share the canonical base, so it can be interned for free */
+        ntp.p_ptr = p_types[bidx];
+    } else if (tp.type() == C_BUILTIN_FUNC) {
+        ntp.p_func = p_funcs[bidx];
+    }
+    ntp.p_flags |= C_TYPE_INTERNED;
+    if (uniq) {
+        ntp.p_flags |= C_TYPE_UNIQUE;
+    }
+    p_types.push_back(util::make_rc<c_type>(util::move(ntp)));
+    return p_tmap.insert(key, p_types.size() - 1);
+}
+
+c_type const &from_lua_type(lua_State *L, int index) {
     switch (lua_type(L, index)) {
-        case LUA_TNIL:
-            return c_type{
-                util::make_rc<c_type>(C_BUILTIN_VOID, 0),
-                0, C_BUILTIN_PTR
-            };
         case LUA_TBOOLEAN:
-            return c_type{C_BUILTIN_BOOL, 0};
+            return decl_store::get_main(L).intern(c_type{C_BUILTIN_BOOL, 0});
         case LUA_TNUMBER:
             static_assert(
                 builtin_v<lua_Number> != C_BUILTIN_INVALID,
@@ -1483,38 +1806,36 @@ c_type from_lua_type(lua_State *L, int index) {
             );
             /* 5.3+; always returns false on <= 5.2 */
             if (lua_isinteger(L, index)) {
-                return c_type{builtin_v<lua_Integer>, 0};
+                return decl_store::get_main(L).intern(
+                    c_type{builtin_v<lua_Integer>, 0}
+                );
             }
-            return c_type{builtin_v<lua_Number>, 0};
+            return decl_store::get_main(L).intern(
+                c_type{builtin_v<lua_Number>, 0}
+            );
         case LUA_TSTRING:
-            return c_type{
-                util::make_rc<c_type>(C_BUILTIN_CHAR, C_CV_CONST),
-                0, C_BUILTIN_PTR
-            };
-        case LUA_TTABLE:
-        case LUA_TFUNCTION:
-        case LUA_TTHREAD:
-        case LUA_TLIGHTUSERDATA:
-            /* by default use a void pointer, some will fail, that's ok */
-            return c_type{
-                util::make_rc<c_type>(C_BUILTIN_VOID, 0),
-                0, C_BUILTIN_PTR
-            };
+            return decl_store::get_main(L).ptr_to(
+                c_type{C_BUILTIN_CHAR, C_CV_CONST}
+            );
         case LUA_TUSERDATA: {
             auto *cd = ffi::testcdata(L, index);
-            if (!cd) {
-                return c_type{
-                    util::make_rc<c_type>(C_BUILTIN_VOID, 0),
-                    0, C_BUILTIN_PTR
-                };
+            if (cd) {
+                return *cd->decl;
             }
-            return cd->decl.copy();
+            break;
         }
+        case LUA_TNIL:
+        case LUA_TTABLE:
+        case LUA_TFUNCTION:
+        case LUA_TTHREAD:
+        case LUA_TLIGHTUSERDATA:
+            break;
         default:
+            assert(false);
             break;
     }
-    assert(false);
-    return c_type{C_BUILTIN_INVALID, 0};
+    /* by default use a void pointer, some will fail, that's ok */
+    return decl_store::get_main(L).ptr_to(c_type{C_BUILTIN_VOID, 0});
 }
 
 } /* namespace ast */
@@ -254,6 +254,9 @@ enum c_type_flags {
     C_TYPE_NOSIZE = 1 << 2,
     C_TYPE_VLA = 1 << 3,
     C_TYPE_REF = 1 << 4,
+    C_TYPE_INTERNED = 1 << 5,
+    C_TYPE_UNIQUE = 1 << 6,
+    C_TYPE_SHARED = 1 << 7,
 };
 
 enum c_func_flags {
@@ -517,6 +520,7 @@ struct c_object {
 struct c_function;
 struct c_record;
 struct c_enum;
+struct decl_store;
 
 struct c_type: c_object {
     c_type():
@@ -577,6 +581,37 @@ struct c_type: c_object {
         return ret;
     }
 
+    /* whether this is the canonical instance kept by a decl_store;
+     * copies of canonical instances are regular types again
+     */
+    bool interned() const {
+        return p_flags & C_TYPE_INTERNED;
+    }
+
+    /* the reference to an interned or shared type, once it was requested;
+     * kept with the type, as references are made for every access to an
+     * aggregate element or field
+     */
+    c_type const *interned_ref() const {
+        return p_iref;
+    }
+
+    /* whether this is a standalone copy for types the store does not keep,
+     * see decl_store::find; its users hold references to it through
+     * acquire and release, and the last release frees it
+     */
+    bool shared() const {
+        return p_flags & C_TYPE_SHARED;
+    }
+
+    void acquire() const {
+        util::rc_obj<c_type>::acquire(this);
+    }
+
+    void release() const {
+        util::rc_obj<c_type>::release(this);
+    }
+
     void do_serialize(util::strbuf &o, c_object_cont_f cont, void *data) const;
 
     char const *name() const {
@@ -745,6 +780,10 @@ struct c_type: c_object {
         return *p_crec;
     }
 
+    c_enum const &cenum() const {
+        return *p_cenum;
+    }
+
     ffi_type *libffi_type() const;
 
     std::size_t alloc_size() const;
@@ -766,6 +805,8 @@ struct c_type: c_object {
     }
 
 private:
+    friend struct decl_store;
+
     void clear();
     void copy(c_type const &);
 
@@ -777,8 +818,9 @@ private:
         c_enum const *p_cenum;
     };
     std::size_t p_asize = 0;
+    mutable c_type const *p_iref = nullptr;
     std::uint32_t p_ttype: 5;
-    std::uint32_t p_flags: 5;
+    std::uint32_t p_flags: 8;
     std::uint32_t p_cv: 2;
 };
 
@@ -854,6 +896,10 @@ struct c_function: c_object {
         return !!(p_flags & C_FUNC_VARIADIC);
     }
 
+    std::uint32_t flags() const {
+        return p_flags;
+    }
+
     std::uint32_t callconv() const {
         return p_flags & 0xF;
     }
@@ -867,7 +913,6 @@ private:
     c_type p_result;
     util::vector<c_param> p_params;
     std::uint32_t p_flags;
-    bool p_variadic;
 };
 
 struct c_variable: c_object {
@@ -1011,6 +1056,7 @@ struct c_record: c_object {
     ~c_record() {
         delete[] p_elements;
         delete[] p_felems;
+        delete[] p_index;
     }
 
     c_object_type obj_type() const {
@@ -1039,7 +1085,18 @@ struct c_record: c_object {
 
     bool is_same(c_record const &other) const;
 
-    std::ptrdiff_t field_offset(char const *fname, c_type const *&fld) const;
+    std::ptrdiff_t field_offset(char const *fname, c_type const *&fld) const {
+        return field_offset(fname, std::strlen(fname), fld);
+    }
+
+    /* constant time lookup in the flattened field index; when given a
+     * store, the type in the index is replaced by its interned instance,
+     * so the returned type is always interned and later lookups are free
+     */
+    std::ptrdiff_t field_offset(
+        char const *fname, std::size_t nlen, c_type const *&fld,
+        decl_store *ds = nullptr
+    ) const;
 
     bool opaque() const {
         return !p_elements;
@@ -1112,12 +1169,26 @@ struct c_record: c_object {
     }
 
 private:
+    /* an entry in the field index, including transparent members */
+    struct field_entry {
+        char const *name; /* nullptr for empty slots */
+        std::size_t nlen;
+        std::size_t hash;
+        std::size_t off;
+        c_type const *type;
+    };
+
     std::size_t iter_fields(bool (*cb)(
         char const *fname, c_type const &type, std::size_t off, void *data
     ), void *data, std::size_t base, bool &end) const;
 
+    void set_layout();
+    void build_index();
+
     util::strbuf p_name;
     util::vector<field> p_fields{};
+    field_entry *p_index = nullptr;
+    std::size_t p_imask = 0;
     ffi_type **p_elements = nullptr;
     ffi_type **p_felems = nullptr;
     ffi_type p_ffi_type{};
@@ -1197,6 +1268,7 @@ struct decl_store {
     decl_store(decl_store &ds): p_base(&ds) {}
     ~decl_store() {
         drop();
+        set_ptr_intern(false);
     }
 
     decl_store &operator=(decl_store const &) = delete;
@@ -1211,6 +1283,51 @@ struct decl_store {
 
     std::size_t request_name(char *buf, std::size_t bufsize);
 
+    /* the canonical instance of a type; types that differ in nothing but
+     * their identity share one instance, which is kept for as long as the
+     * store exists; staging stores intern into their base, as types may
+     * only reference committed declarations
+     */
+    c_type const &intern(c_type const &tp);
+
+    /* like intern, but only for types whose number is bounded by the
+     * declarations; types built from sized arrays are often made on the
+     * fly with sizes computed at runtime, so these are only looked up,
+     * and if there is no interned instance yet, a new shared copy without
+     * references is returned instead, see c_type::shared
+     */
+    c_type const &find(c_type const &tp);
+
+    /* the pointer to the given type, as returned by find */
+    c_type const &ptr_to(c_type const &tp);
+
+    /* the reference to the given type, as returned by find */
+    c_type const &ref_to(c_type const &tp);
+
+    bool empty() const {
+        return p_dlist.empty();
+    }
+
+    /* whether pointers converted to lua are interned in the state owning
+     * the store; the number of such states is kept too, so that when
+     * there are none, conversions need not look up anything at all
+     */
+    bool ptr_intern() const {
+        return p_ptr_intern;
+    }
+
+    void set_ptr_intern(bool v);
+
+    static bool ptr_intern_any();
+
+    /* visits the objects of this store in the order they were added */
+    template<typename F>
+    void for_each(F &&func) const {
+        for (std::size_t i = 0; i < p_dlist.size(); ++i) {
+            func(*p_dlist[i].value);
+        }
+    }
+
     static decl_store &get_main(lua_State *L) {
         lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_DECL_STOR);
         auto *ds = lua::touserdata<decl_store>(L, -1);
@@ -1219,6 +1336,58 @@ struct decl_store {
         return *ds;
     }
 private:
+    /* identifies an interned type; the reference is the interned base for
+     * pointers and arrays, or the declaration for records, enums and
+     * functions, so the key is flat and compared memberwise
+     */
+    struct type_key {
+        void const *ref;
+        std::size_t asize;
+        std::uint32_t bits;
+    };
+
+    struct type_hash {
+        std::size_t operator()(type_key const &k) const {
+            auto h = util::pun<std::uintptr_t>(k.ref);
+            h ^= (h >> 9) ^ (std::uintptr_t(k.bits) << 16);
+            return std::size_t(h) ^ (k.asize * 31);
+        }
+    };
+
+    struct type_equal {
+        bool operator()(type_key const &k1, type_key const &k2) const {
+            return (
+                (k1.ref == k2.ref) && (k1.asize == k2.asize) &&
+                (k1.bits == k2.bits)
+            );
+        }
+    };
+
+    /* functions are identified by their signature; the hash is computed
+     * from the interned result and parameter types when interning
+     */
+    struct func_key {
+        c_function const *func;
+        std::size_t hash;
+    };
+
+    struct func_hash {
+        std::size_t operator()(func_key const &k) const {
+            return k.hash;
+        }
+    };
+
+    struct func_equal {
+        bool operator()(func_key const &k1, func_key const &k2) const;
+    };
+
+    std::size_t intern_idx(c_type const &tp);
+    void declare(c_object const &d);
+    std::size_t find_idx(c_type const &tp);
+    c_type const &share(c_type const &tp);
+    bool make_key(c_type const &tp, std::size_t bidx, type_key &key);
+    std::size_t intern_func(util::rc_obj<c_function> const &func);
+
     struct obj_ptr {
         c_object *value = nullptr;
         obj_ptr(c_object *v): value{v} {}
@@ -1229,10 +1398,16 @@ private:
     decl_store *p_base = nullptr;
     util::vector<obj_ptr> p_dlist{};
     util::str_map<c_object *> p_dmap{};
+    util::vector<util::rc_obj<c_type>> p_types{};
+    util::map<type_key, std::size_t, type_hash, type_equal> p_tmap{};
+    util::vector<util::rc_obj<c_function>> p_funcs{};
+    util::map<func_key, std::size_t, func_hash, func_equal> p_fmap{};
     std::size_t name_counter = 0;
+    bool p_ptr_intern = false;
 };
 
-c_type from_lua_type(lua_State *L, int index);
+/* the interned type a Lua value is passed as to variadic functions */
+c_type const &from_lua_type(lua_State *L, int index);
 
 } /* namespace ast */
 
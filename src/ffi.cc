@@ -1,3 +1,5 @@
+#include <cstdlib>
+
 #include "platform.hh"
 #include "util.hh"
 #include "ffi.hh"
@@ -50,10 +52,10 @@ static ffi_type *lua_to_vararg(lua_State *L, int index) {
         case LUA_TUSERDATA: {
             auto *cd = testcdata(L, index);
             /* plain userdata or struct values are passed to varargs as ptrs */
-            if (!cd || (cd->decl.type() == ast::C_BUILTIN_RECORD)) {
+            if (!cd || (cd->decl->type() == ast::C_BUILTIN_RECORD)) {
                 return &ffi_type_pointer;
             }
-            return cd->decl.libffi_type();
+            return cd->decl->libffi_type();
         }
         default:
             break;
@@ -62,89 +64,219 @@ static ffi_type *lua_to_vararg(lua_State *L, int index) {
     return &ffi_type_void;
 }
 
-static inline void *fdata_retval(fdata &fd) {
-    return &fd.rarg;
+void set_finalizer(lua_State *L, int idx, int fidx) {
+    auto &cd = tocdata(L, idx);
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_FINALIZERS);
+    lua_pushlightuserdata(L, &cd);
+    lua_pushvalue(L, fidx);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    if (lua_isnil(L, fidx)) {
+        cd.flags &= ~std::uint32_t(CDATA_FINALIZER);
+        return;
+    }
+    cd.flags |= CDATA_FINALIZER;
+    /* make sure the cdata is finalized at all */
+    lua_pushvalue(L, idx);
+    lua::mark_cdata(L);
+    lua_pop(L, 1);
 }
 
-static inline ffi::scalar_stor_t *&fdata_get_aux(fdata &fd) {
-    return *util::pun<ffi::scalar_stor_t **>(fd.args());
+static void unref_closure(lua_State *L, cdata &cd);
+
+void destroy_cdata(lua_State *L, cdata &cd) {
+    if (cd.flags & CDATA_FINALIZER) {
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_FINALIZERS);
+        lua_pushlightuserdata(L, &cd);
+        lua_rawget(L, -2);
+        /* clear the entry first, its address may be reused later */
+        lua_pushlightuserdata(L, &cd);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+        lua_remove(L, -2);
+        cd.flags &= ~std::uint32_t(CDATA_FINALIZER);
+        lua_pushvalue(L, 1); /* the cdata */
+        if (lua_pcall(L, 1, 0, 0)) {
+            lua_pop(L, 1);
+        }
+    }
+    if (cd.flags & CDATA_CLOSURE) {
+        unref_closure(L, cd);
+    }
+    /* after the finalizer, which may still look at the type */
+    if (cd.flags & CDATA_OWNDECL) {
+        cd.flags &= ~std::uint32_t(CDATA_OWNDECL);
+        cd.decl->release();
+    }
 }
 
-static inline void fdata_free_aux(lua_State *, fdata &fd) {
-    auto &ptr = fdata_get_aux(fd);
-    delete[] util::pun<unsigned char *>(ptr);
-    ptr = nullptr;
+void *arena::alloc(std::size_t sz) {
+    /* keep every allocation aligned for any type */
+    auto mod = sz % alignof(util::max_aligned_t);
+    if (mod) {
+        auto pad = alignof(util::max_aligned_t) - mod;
+        if (sz > (util::limit_max<std::size_t>() - pad)) {
+            return nullptr;
+        }
+        sz += pad;
+    }
+    if (chunks && ((chunks->size - used) >= sz)) {
+        auto *ret = chunks->data() + used;
+        used += sz;
+        return ret;
+    }
+    /* grow geometrically, large values get a chunk of their own */
+    if (chunks && (csize < (1 << 20))) {
+        csize *= 2;
+    }
+    auto csz = (sz > csize) ? sz : csize;
+    auto hsz = sizeof(chunk) + alignof(util::max_aligned_t);
+    if (csz > (util::limit_max<std::size_t>() - hsz)) {
+        return nullptr;
+    }
+    /* not through operator new, which cannot fail gracefully */
+    auto *ch = static_cast<chunk *>(std::malloc(hsz + csz));
+    if (!ch) {
+        return nullptr;
+    }
+    ch->next = chunks;
+    ch->size = csz;
+    chunks = ch;
+    used = sz;
+    return ch->data();
 }
 
-static inline void fdata_new_aux(lua_State *, fdata &fd, std::size_t sz) {
-    fdata_get_aux(fd) = util::pun<ffi::scalar_stor_t *>(new unsigned char[sz]);
+void arena::release(chunk *ch) {
+    while (ch) {
+        auto *nch = ch->next;
+        std::free(ch);
+        ch = nch;
+    }
 }
 
-static inline ffi_type **fargs_types(ffi::scalar_stor_t *args, std::size_t nargs) {
-    /* see memory layout comment below; this accesses the beginning
-     * of the ffi_type section within the fdata structure
-     */
-    return util::pun<ffi_type **>(args + nargs);
+void destroy_closure(lua_State *, closure_data *cd) {
+    cd->~closure_data();
+    delete[] util::pun<unsigned char *>(cd);
 }
 
-static inline void **fargs_values(ffi::scalar_stor_t *args, std::size_t nargs) {
-    /* this accesses the value pointers that follow the ffi_type pointers */
-    return util::pun<void **>(fargs_types(args, nargs) + nargs);
+closure_pool &get_closure_pool(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CLOSURE_POOL);
+    auto *pool = lua::touserdata<closure_pool>(L, -1);
+    lua_pop(L, 1);
+    return *pool;
 }
 
-void destroy_cdata(lua_State *L, cdata &cd) {
-    if (cd.gc_ref >= 0) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, cd.gc_ref);
-        lua_pushvalue(L, 1); /* the cdata */
-        if (lua_pcall(L, 1, 0, 0)) {
-            lua_pop(L, 1);
-        }
-        luaL_unref(L, LUA_REGISTRYINDEX, cd.gc_ref);
+static closure_data *acquire_closure(
+    lua_State *L, ast::c_function const *func
+) {
+    auto &pool = get_closure_pool(L);
+    auto *head = pool.free.find(func);
+    if (!head || !*head) {
+        return nullptr;
+    }
+    auto *cd = *head;
+    *head = cd->next;
+    cd->next = nullptr;
+    cd->freed = false;
+    --pool.count;
+    return cd;
+}
+
+/* the handle at the top of the stack refers to the closure; handles that
+ * do are finalized, so that a copied handle keeps the closure out of the
+ * pool for as long as it exists, and can tell that it was freed
+ */
+static void ref_closure(lua_State *L, fdata &fd, closure_data *cd) {
+    fd.cd = cd;
+    ++cd->nhandles;
+    tocdata(L, -1).flags |= CDATA_CLOSURE;
+    lua::mark_cdata(L);
+}
+
+static void pool_closure(lua_State *L, closure_data *cd) {
+    auto &pool = get_closure_pool(L);
+    if (pool.count >= pool.max) {
+        destroy_closure(L, cd);
+        return;
     }
-    switch (cd.decl.type()) {
-        case ast::C_BUILTIN_PTR:
-            if (cd.decl.ptr_base().type() != ast::C_BUILTIN_FUNC) {
-                break;
-            }
-            goto free_aux;
-        free_aux:
-        case ast::C_BUILTIN_FUNC: {
-            /* ctypes don't have any aux data! */
-            if (!cd.decl.function()->variadic() || isctype(cd)) {
-                break;
+    auto &head = pool.free.insert(cd->func, nullptr);
+    cd->next = head;
+    head = cd;
+    ++pool.count;
+}
+
+static void unref_closure(lua_State *L, cdata &cd) {
+    cd.flags &= ~std::uint32_t(CDATA_CLOSURE);
+    auto *clos = util::exchange(cd.as<fdata>().cd, nullptr);
+    /* callbacks that were never freed may still be in use by C */
+    if (!--clos->nhandles && clos->freed) {
+        pool_closure(L, clos);
+    }
+}
+
+void release_closure(lua_State *L, int idx) {
+    auto &cd = tocdata(L, idx);
+    auto *clos = cd.as<fdata>().cd;
+    if (clos->freed) {
+        luaL_error(L, "callback already freed");
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, clos->fref);
+    clos->fref = LUA_REFNIL;
+    clos->freed = true;
+    /* prevent it from being set again, it may be reused already */
+    unref_closure(L, cd);
+}
+
+std::size_t resize_closure_pool(lua_State *L, std::size_t max) {
+    auto &pool = get_closure_pool(L);
+    auto ret = pool.max;
+    pool.max = max;
+    if (pool.count > max) {
+        pool.free.for_each([L, &pool](
+            ast::c_function const *, closure_data *&head
+        ) {
+            while (head && (pool.count > pool.max)) {
+                auto *cd = head;
+                head = cd->next;
+                destroy_closure(L, cd);
+                --pool.count;
             }
-            fdata_free_aux(L, cd.as<fdata>());
-        }
-        default:
-            break;
+        });
     }
-    using T = ast::c_type;
-    cd.decl.~T();
+    return ret;
 }
 
-void destroy_closure(lua_State *, closure_data *cd) {
-    cd->~closure_data();
-    delete[] util::pun<unsigned char *>(cd);
+void destroy_closure_pool(lua_State *L, closure_pool &pool) {
+    pool.free.for_each([L](ast::c_function const *, closure_data *head) {
+        while (head) {
+            auto *cd = head;
+            head = cd->next;
+            destroy_closure(L, cd);
+        }
+    });
+    pool.~closure_pool();
+    /* handles finalized after the pool destroy their closures right away */
+    new (&pool) closure_pool{};
+    pool.max = 0;
 }
 
 static void cb_bind(ffi_cif *, void *ret, void *args[], void *data) {
-    auto &fud = *static_cast<cdata *>(data);
-    auto &fun = fud.decl.function();
-    auto &pars = fun->params();
+    closure_data &cd = *static_cast<closure_data *>(data);
+    auto &fun = *cd.func;
+    auto &pars = fun.params();
     auto fargs = pars.size();
 
-    closure_data &cd = *fud.as<fdata>().cd;
     lua_rawgeti(cd.L, LUA_REGISTRYINDEX, cd.fref);
     for (std::size_t i = 0; i < fargs; ++i) {
         to_lua(cd.L, pars[i].type(), args[i], RULE_PASS, false);
     }
 
-    if (fun->result().type() != ast::C_BUILTIN_VOID) {
+    if (fun.result().type() != ast::C_BUILTIN_VOID) {
         lua_call(cd.L, int(fargs), 1);
         ffi::scalar_stor_t stor{};
         std::size_t rsz;
         void *rp = from_lua(
-            cd.L, fun->result(), &stor, -1, rsz, RULE_RET
+            cd.L, fun.result(), &stor, -1, rsz, RULE_RET
         );
         std::memcpy(ret, rp, rsz);
         lua_pop(cd.L, 1);
@@ -153,6 +285,10 @@ static void cb_bind(ffi_cif *, void *ret, void *args[], void *data) {
     }
 }
 
+/* defined below, once the scalar converters are available */
+static bool prepare_cb_fast(lua_State *L, closure_data &cd);
+static void cb_bind_fast(ffi_cif *, void *ret, void *args[], void *data);
+
 #if defined(FFI_WINDOWS_ABI) && (FFI_ARCH == FFI_ARCH_X86)
 static inline ffi_abi to_libffi_abi(int conv) {
     switch (conv) {
@@ -178,6 +314,156 @@ static inline ffi_abi to_libffi_abi(int) {
 }
 #endif
 
+/* direct calls for common signatures
+ *
+ * non-variadic functions with the default calling convention, taking at
+ * most FAST_MAX_ARGS arguments, where the return type and all argument
+ * types are among the types below, are called through a function pointer
+ * of the right type instead of through libffi; the arguments are still
+ * converted the same way as for any other call
+ */
+static constexpr std::size_t FAST_MAX_ARGS = 2;
+
+static bool fast_arg(ast::c_type const &tp) {
+    if (tp.is_ref()) {
+        return false;
+    }
+    switch (tp.type()) {
+        case ast::C_BUILTIN_INT:
+        case ast::C_BUILTIN_UINT:
+        case ast::C_BUILTIN_LONG:
+        case ast::C_BUILTIN_ULONG:
+        case ast::C_BUILTIN_DOUBLE:
+        case ast::C_BUILTIN_PTR:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+template<ast::c_builtin T>
+using fast_t = typename ast::builtin_traits<T>::type;
+
+template<typename R>
+struct fast_ret {
+    template<typename F, typename ...A>
+    static void call(F fp, void *rval, A ...args) {
+        R rv = fp(args...);
+        std::memcpy(rval, &rv, sizeof(R));
+    }
+};
+
+template<>
+struct fast_ret<void> {
+    template<typename F, typename ...A>
+    static void call(F fp, void *, A ...args) {
+        fp(args...);
+    }
+};
+
+template<typename R, typename ...A>
+struct fast_call;
+
+template<typename R>
+struct fast_call<R> {
+    static void call(void (*sym)(), void **, void *rval) {
+        fast_ret<R>::call(util::pun<R (*)()>(sym), rval);
+    }
+};
+
+template<typename R, typename A1>
+struct fast_call<R, A1> {
+    static void call(void (*sym)(), void **args, void *rval) {
+        fast_ret<R>::call(
+            util::pun<R (*)(A1)>(sym), rval, *static_cast<A1 *>(args[0])
+        );
+    }
+};
+
+template<typename R, typename A1, typename A2>
+struct fast_call<R, A1, A2> {
+    static void call(void (*sym)(), void **args, void *rval) {
+        fast_ret<R>::call(
+            util::pun<R (*)(A1, A2)>(sym), rval,
+            *static_cast<A1 *>(args[0]), *static_cast<A2 *>(args[1])
+        );
+    }
+};
+
+/* picks the trampoline matching the signature, one argument at a time */
+template<std::size_t N, typename ...A>
+struct fast_sel {
+    static fast_tramp get(ast::c_function const &func, std::size_t i) {
+        auto &pars = func.params();
+        if (i == pars.size()) {
+            return get_ret(func.result());
+        }
+        if (!fast_arg(pars[i].type())) {
+            return nullptr;
+        }
+        switch (pars[i].type().type()) {
+#define FAST_ARG(bt) \
+            case ast::bt: \
+                return fast_sel<N - 1, A..., fast_t<ast::bt>>::get(func, i + 1);
+            FAST_ARG(C_BUILTIN_INT)
+            FAST_ARG(C_BUILTIN_UINT)
+            FAST_ARG(C_BUILTIN_LONG)
+            FAST_ARG(C_BUILTIN_ULONG)
+            FAST_ARG(C_BUILTIN_DOUBLE)
+            FAST_ARG(C_BUILTIN_PTR)
+#undef FAST_ARG
+            default:
+                break;
+        }
+        return nullptr;
+    }
+
+    static fast_tramp get_ret(ast::c_type const &tp) {
+        if (tp.type() == ast::C_BUILTIN_VOID) {
+            return &fast_call<void, A...>::call;
+        }
+        if (!fast_arg(tp)) {
+            return nullptr;
+        }
+        switch (tp.type()) {
+#define FAST_RET(bt) \
+            case ast::bt: \
+                return &fast_call<fast_t<ast::bt>, A...>::call;
+            FAST_RET(C_BUILTIN_INT)
+            FAST_RET(C_BUILTIN_UINT)
+            FAST_RET(C_BUILTIN_LONG)
+            FAST_RET(C_BUILTIN_ULONG)
+            FAST_RET(C_BUILTIN_DOUBLE)
+            FAST_RET(C_BUILTIN_PTR)
+#undef FAST_RET
+            default:
+                break;
+        }
+        return nullptr;
+    }
+};
+
+template<typename ...A>
+struct fast_sel<0, A...> {
+    static fast_tramp get(ast::c_function const &func, std::size_t i) {
+        if (i == func.params().size()) {
+            return fast_sel<1, A...>::get_ret(func.result());
+        }
+        return nullptr;
+    }
+};
+
+static fast_tramp get_fast_tramp(ast::c_function const &func) {
+    if (func.variadic() || (func.callconv() != ast::C_FUNC_DEFAULT)) {
+        return nullptr;
+    }
+    if (func.params().size() > FAST_MAX_ARGS) {
+        return nullptr;
+    }
+    return fast_sel<FAST_MAX_ARGS>::get(func, 0);
+}
+
 /* this initializes a non-vararg cif with the given number of arguments
  * for variadics, this is initialized once for zero args, and then handled
  * dynamically before every call
@@ -210,15 +496,9 @@ static void make_cdata_func(
      *     <cdata header>
      *     struct fdata {
      *         <fdata header>
-     *         ffi::scalar_stor_t val1; // lua arg1
-     *         ffi::scalar_stor_t val2; // lua arg2
-     *         ffi::scalar_stor_t valN; // lua argN
      *         ffi_type *arg1; // type
      *         ffi_type *arg2; // type
      *         ffi_type *argN; // type
-     *         void *valp1;    // &val1
-     *         void *valpN;    // &val2
-     *         void *valpN;    // &valN
      *     } val;
      * }
      *
@@ -228,46 +508,82 @@ static void make_cdata_func(
      *     <cdata header>
      *     struct fdata {
      *         <fdata header>
-     *         void *aux; // vals + types + args like above, but dynamic
+     *         struct vararg_cache vcache; // prepared cifs
      *     } val;
      * }
+     *
+     * the argument values are never stored here, see call_cif
      */
+    auto fsz = sizeof(fdata) + (func->variadic()
+        ? sizeof(vararg_cache) : sizeof(ffi_type *) * nargs);
+    bool pooled = false;
+    if (!funp && !cd) {
+        /* a freed callback of the same signature comes fully prepared,
+         * including the cif and the type of the handle
+         */
+        cd = acquire_closure(L, func.get());
+        pooled = !!cd;
+        if (pooled && (cd->decl->type() == (
+            fptr ? ast::C_BUILTIN_PTR : ast::C_BUILTIN_FUNC
+        ))) {
+            auto &pfd = newcdata(L, *cd->decl, fsz).as<fdata>();
+            pfd.sym = cd->sym;
+            ref_closure(L, pfd, cd);
+            pfd.fast = get_fast_tramp(*func);
+            pfd.cif = cd->cif;
+            pfd.cif.arg_types = pfd.types();
+            for (std::size_t i = 0; i < nargs; ++i) {
+                pfd.types()[i] = cd->cif.arg_types[i];
+            }
+            cd->L = L;
+            return;
+        }
+    }
     ast::c_type funct{func, 0, funp == nullptr};
     auto &fud = newcdata(
         L, fptr ? ast::c_type{
             util::make_rc<ast::c_type>(util::move(funct)),
             0, ast::C_BUILTIN_PTR
-        } : util::move(funct),
-        sizeof(fdata) + (func->variadic() ? sizeof(void *) : (
-            sizeof(ffi::scalar_stor_t) * nargs + sizeof(void *) * nargs * 2
-        ))
+        } : util::move(funct), fsz
     );
     fud.as<fdata>().sym = funp;
+    fud.as<fdata>().fast = get_fast_tramp(*func);
 
     if (func->variadic()) {
-        fdata_get_aux(fud.as<fdata>()) = nullptr;
         if (!funp) {
             luaL_error(L, "variadic callbacks are not supported");
         }
         nargs = 0;
+        auto &vc = fud.as<fdata>().vcache();
+        vc.next = 0;
+        for (auto &slot: vc.slots) {
+            slot.nargs = 0;
+        }
     }
 
     if (!prepare_cif(
-        func, fud.as<fdata>().cif,
-        fargs_types(fud.as<fdata>().args(), nargs), nargs
+        func, fud.as<fdata>().cif, fud.as<fdata>().types(), nargs
     )) {
         luaL_error(L, "unexpected failure setting up '%s'", func->name());
     }
 
     if (!funp) {
         /* no funcptr means we're setting up a callback */
-        if (cd) {
+        if (cd && !pooled) {
             /* copying existing callback reference */
-            fud.as<fdata>().cd = cd;
+            fud.as<fdata>().sym = cd->sym;
+            ref_closure(L, fud.as<fdata>(), cd);
+            return;
+        } else if (cd) {
+            /* pooled, but for the other kind of handle */
+            cd->L = L;
+            fud.as<fdata>().sym = cd->sym;
+            ref_closure(L, fud.as<fdata>(), cd);
             return;
         }
         cd = util::pun<closure_data *>(new unsigned char[
-            sizeof(closure_data) + nargs * sizeof(ffi_type *)
+            sizeof(closure_data) +
+            nargs * (sizeof(ffi_type *) + sizeof(cb_arg))
         ]);
         new (cd) closure_data{};
         /* allocate a closure in it */
@@ -284,14 +600,17 @@ static void make_cdata_func(
                 lua_tostring(L, -1)
             );
         }
-        /* arg pointers follow closure data struct, as allocated above */
-        auto **targs = util::pun<ffi_type **>(cd + 1);
-        if (!prepare_cif(fud.decl.function(), cd->cif, targs, nargs)) {
+        if (!prepare_cif(fud.decl->function(), cd->cif, cd->types(), nargs)) {
             destroy_closure(L, cd);
             luaL_error(L, "unexpected failure setting up '%s'", func->name());
         }
+        cd->func = fud.decl->function().get();
+        /* the closure must not depend on the handle, which may go away
+         * while C still holds the function pointer
+         */
         if (ffi_prep_closure_loc(
-            cd->closure, &fud.as<fdata>().cif, cb_bind, &fud, symp
+            cd->closure, &cd->cif,
+            prepare_cb_fast(L, *cd) ? cb_bind_fast : cb_bind, cd, symp
         ) != FFI_OK) {
             destroy_closure(L, cd);
             func->serialize(L);
@@ -301,28 +620,21 @@ static void make_cdata_func(
             );
         }
         cd->L = L;
-        fud.as<fdata>().cd = cd;
+        cd->decl = fud.decl;
+        cd->sym = fud.as<fdata>().sym;
+        ref_closure(L, fud.as<fdata>(), cd);
     }
 }
 
+/* the same function tends to be called with the same few argument shapes,
+ * so the prepared cifs are kept in the function cdata, keyed by the types;
+ * a cached cif is always copied out, as a call may reenter and replace it
+ */
 static bool prepare_cif_var(
-    lua_State *L, cdata &fud, std::size_t nargs, std::size_t fargs
+    lua_State *L, util::rc_obj<ast::c_function> const &func,
+    vararg_cache &vc, ffi_cif &cif, ffi_type **targs,
+    std::size_t nargs, std::size_t fargs
 ) {
-    auto &func = fud.decl.function();
-
-    auto &auxptr = fdata_get_aux(fud.as<fdata>());
-    if (auxptr && (nargs > std::size_t(fud.aux))) {
-        fdata_free_aux(L, fud.as<fdata>());
-    }
-    if (!auxptr) {
-        fdata_new_aux(
-            L, fud.as<fdata>(),
-            nargs * sizeof(ffi::scalar_stor_t) + 2 * nargs * sizeof(void *)
-        );
-        fud.aux = int(nargs);
-    }
-
-    ffi_type **targs = fargs_types(auxptr, nargs);
     for (std::size_t i = 0; i < fargs; ++i) {
         targs[i] = func->params()[i].libffi_type();
     }
@@ -330,32 +642,107 @@ static bool prepare_cif_var(
         targs[i] = lua_to_vararg(L, int(i + 2));
     }
 
+    bool cacheable = (nargs > 0) && (nargs <= VARARG_CIF_ARGS);
+    if (cacheable) {
+        for (auto &slot: vc.slots) {
+            if ((slot.nargs != nargs) || std::memcmp(
+                slot.types, targs, nargs * sizeof(ffi_type *)
+            )) {
+                continue;
+            }
+            cif = slot.cif;
+            cif.arg_types = targs;
+            return true;
+        }
+    }
+
     using U = unsigned int;
-    return (ffi_prep_cif_var(
-        &fud.as<fdata>().cif, to_libffi_abi(func->callconv()), U(fargs), U(nargs),
+    if (ffi_prep_cif_var(
+        &cif, to_libffi_abi(func->callconv()), U(fargs), U(nargs),
         func->result().libffi_type(), targs
-    ) == FFI_OK);
+    ) != FFI_OK) {
+        return false;
+    }
+
+    if (cacheable) {
+        auto &slot = vc.slots[vc.next];
+        vc.next = (vc.next + 1) % VARARG_CIF_SLOTS;
+        slot.cif = cif;
+        slot.nargs = nargs;
+        std::memcpy(slot.types, targs, nargs * sizeof(ffi_type *));
+    }
+    return true;
 }
 
+/* calls have to be reentrant, as the C function may call back into Lua,
+ * which may call the same function again; therefore the argument values
+ * are never stored in the function cdata - calls with few arguments keep
+ * them on the C stack, other calls allocate a temporary userdata
+ */
+static constexpr std::size_t CALL_STACK_ARGS = 16;
+
 int call_cif(cdata &fud, lua_State *L, std::size_t largs) {
-    auto &func = fud.decl.function();
+    auto &func = fud.decl->function();
     auto &pdecls = func->params();
 
     auto nargs = pdecls.size();
     auto targs = nargs;
+    if (func->variadic()) {
+        targs = util::max(largs, nargs);
+    }
+    if (largs < nargs) {
+        /* check early, the argument storage may occupy the stack slot */
+        fail_convert_tp(L, "no value", pdecls[largs].type());
+    }
+
+    /* records may be returned by value, so these may need more room */
+    std::size_t rslots = 1;
+    if (func->result().type() == ast::C_BUILTIN_RECORD) {
+        auto ssz = sizeof(ffi::scalar_stor_t);
+        rslots = util::max(
+            rslots, (func->result().alloc_size() + ssz - 1) / ssz
+        );
+    }
 
-    ffi::scalar_stor_t *pvals = fud.as<fdata>().args();
-    void *rval = fdata_retval(fud.as<fdata>());
+    ffi::scalar_stor_t sstor[CALL_STACK_ARGS + 1];
+    void *svals[CALL_STACK_ARGS];
+    ffi_type *stypes[CALL_STACK_ARGS];
+
+    ffi::scalar_stor_t *rval = &sstor[0];
+    ffi::scalar_stor_t *pvals = &sstor[1];
+    void **vals = svals;
+    ffi_type **tvals = stypes;
+
+    if ((targs > CALL_STACK_ARGS) || (rslots > 1)) {
+        /* MEMORY LAYOUT:
+         *
+         * ffi::scalar_stor_t ret[rslots]; // return value
+         * ffi::scalar_stor_t val[targs];  // lua args
+         * void *valp[targs];              // &val[i]
+         * ffi_type *arg[targs];           // vararg types
+         */
+        void *bp = lua_newuserdata(
+            L, (rslots + targs) * sizeof(ffi::scalar_stor_t) +
+            2 * targs * sizeof(void *) + alignof(util::max_aligned_t)
+        );
+        rval = static_cast<ffi::scalar_stor_t *>(util::ptr_align(bp));
+        pvals = rval + rslots;
+        vals = util::pun<void **>(pvals + targs);
+        tvals = util::pun<ffi_type **>(vals + targs);
+    }
+
+    ffi_cif *cif = &fud.as<fdata>().cif;
+    ffi_cif vcif;
 
     if (func->variadic()) {
-        targs = util::max(largs, nargs);
-        if (!prepare_cif_var(L, fud, targs, nargs)) {
+        if (!prepare_cif_var(
+            L, func, fud.as<fdata>().vcache(), vcif, tvals, targs, nargs
+        )) {
             luaL_error(L, "unexpected failure setting up '%s'", func->name());
         }
-        pvals = fdata_get_aux(fud.as<fdata>());
+        cif = &vcif;
     }
 
-    void **vals = fargs_values(pvals, targs);
     /* fixed args */
     for (int i = 0; i < int(nargs); ++i) {
         std::size_t rsz;
@@ -366,20 +753,52 @@ int call_cif(cdata &fud, lua_State *L, std::size_t largs) {
     /* variable args */
     for (int i = int(nargs); i < int(targs); ++i) {
         std::size_t rsz;
-        auto tp = ast::from_lua_type(L, i + 2);
+        auto &tp = ast::from_lua_type(L, i + 2);
         if (tp.type() == ast::C_BUILTIN_RECORD) {
             /* special case for vararg passing of records: by ptr */
-            auto &cd = tocdata(L, i + 2);
-            std::memcpy(&pvals[i], cd.as_ptr(), sizeof(void *));
+            void *rp = tocdata(L, i + 2).as_deref_ptr();
+            std::memcpy(&pvals[i], &rp, sizeof(void *));
+            vals[i] = &pvals[i];
             continue;
         }
-        vals[i] = from_lua(L, util::move(tp), &pvals[i], i + 2, rsz, RULE_PASS);
+        vals[i] = from_lua(L, tp, &pvals[i], i + 2, rsz, RULE_PASS);
     }
 
-    ffi_call(&fud.as<fdata>().cif, fud.as<fdata>().sym, rval, vals);
+    auto &fd = fud.as<fdata>();
+    if (fd.fast) {
+        /* the return value is stored as is, not widened like by libffi */
+        fd.fast(fd.sym, vals, rval);
+        return to_lua(L, func->result(), rval, RULE_RET, false);
+    }
+    ffi_call(cif, fd.sym, rval, vals);
     return to_lua(L, func->result(), rval, RULE_RET, true);
 }
 
+/* values created during conversions, optionally as references */
+static inline cdata &newcdata_conv(
+    lua_State *L, ast::c_type const &tp, std::size_t vals, bool ref = false
+) {
+    return newcdata(L, ref ? *intern_ref(L, tp) : tp, vals);
+}
+
+/* whether the integer value is exactly representable as LT */
+template<typename LT, typename T>
+static inline bool int_fits(T v) {
+    using U = unsigned long long;
+    constexpr U lim = U(1) << util::limit_digits<LT>();
+    if (util::is_signed<T>::value && (v < T(0))) {
+        return (U(0) - U(v)) <= lim;
+    }
+    return U(v) < lim;
+}
+
+static bool unbox64(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_UNBOX64);
+    bool ret = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return ret;
+}
+
 template<typename T>
 static inline int push_int(
     lua_State *L, ast::c_type const &tp, void const *value, bool rv, bool lossy
@@ -406,8 +825,19 @@ static inline int push_int(
         lua_pushinteger(L, lua_Integer(actual_val));
         return 1;
     }
+    /* the type does not fit, but the value might; with unboxing enabled,
+     * such values are returned as plain numbers to avoid the allocation
+     */
+    if (int_fits<LT>(actual_val) && unbox64(L)) {
+#if LUA_VERSION_NUM < 503
+        lua_pushnumber(L, lua_Number(actual_val));
+#else
+        lua_pushinteger(L, lua_Integer(actual_val));
+#endif
+        return 1;
+    }
     /* doesn't fit into the range, so make scalar cdata */
-    auto &cd = newcdata(L, tp, sizeof(T));
+    auto &cd = newcdata_conv(L, tp, sizeof(T));
     std::memcpy(cd.as_ptr(), &actual_val, sizeof(T));
     return 1;
 }
@@ -422,11 +852,64 @@ static inline int push_flt(
         lua_pushnumber(L, lua_Number(*U(value)));
         return 1;
     }
-    auto &cd = newcdata(L, tp, sizeof(T));
+    auto &cd = newcdata_conv(L, tp, sizeof(T));
     std::memcpy(cd.as_ptr(), value, sizeof(T));
     return 1;
 }
 
+/* with pointer interning enabled, pointers converted into Lua are looked
+ * up by their type and address, so the same pointer always gives the same
+ * cdata while that is alive; there is a table per interned type, holding
+ * the cdata weakly by address
+ *
+ * it is usually disabled in every state, which is known without looking
+ * at the registry, where the table would be
+ */
+static void push_ptr(lua_State *L, ast::c_type const &tp, void *addr) {
+    if (!ast::decl_store::ptr_intern_any()) {
+        newcdata_conv(L, tp, sizeof(void *)).as<void *>() = addr;
+        return;
+    }
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_PTR_INTERN);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        newcdata_conv(L, tp, sizeof(void *)).as<void *>() = addr;
+        return;
+    }
+    auto *decl = find_decl(L, tp);
+    if (decl->shared()) {
+        /* types that are not kept have no lasting identity to key by */
+        lua_pop(L, 1);
+        newcdata(L, *decl, sizeof(void *)).as<void *>() = addr;
+        return;
+    }
+    lua_pushlightuserdata(L, const_cast<ast::c_type *>(decl));
+    lua_rawget(L, -2);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_newtable(L);
+        lua_pushliteral(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushlightuserdata(L, const_cast<ast::c_type *>(decl));
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_pushlightuserdata(L, addr);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        newcdata(L, *decl, sizeof(void *)).as<void *>() = addr;
+        lua_pushlightuserdata(L, addr);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    /* leave just the cdata */
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+}
+
 int to_lua(
     lua_State *L, ast::c_type const &tp, void const *value,
     int rule, bool ffi_ret, bool lossy
@@ -447,7 +930,7 @@ int to_lua(
             ffi_ret = false;
         } else {
             /* reference cdata */
-            newcdata(L, tp, sizeof(void *)).as<void *>() = dval;
+            newcdata_conv(L, tp, sizeof(void *)).as<void *>() = dval;
             return 1;
         }
     }
@@ -497,8 +980,7 @@ int to_lua(
             /* pointers should be handled like large cdata, as they need
              * to be represented as userdata objects on lua side either way
              */
-            newcdata(L, tp, sizeof(void *)).as<void *>() =
-                *static_cast<void * const *>(value);
+            push_ptr(L, tp, *static_cast<void * const *>(value));
             return 1;
 
         case ast::C_BUILTIN_VA_LIST:
@@ -534,7 +1016,7 @@ int to_lua(
              *
              * we need to create a C++ style reference in possible cases
              */
-            auto &cd = newcdata(L, tp.as_ref(), sizeof(void *) * 2);
+            auto &cd = newcdata_conv(L, tp, sizeof(void *) * 2, true);
             cd.as<void const *[2]>()[1] = value;
             cd.as<void const *[2]>()[0] = &cd.as<void const *[2]>()[1];
             return 1;
@@ -542,11 +1024,13 @@ int to_lua(
 
         case ast::C_BUILTIN_RECORD: {
             if (rule == RULE_CONV) {
-                newcdata(L, tp.as_ref(), sizeof(void *)).as<void const *>() = value;
+                newcdata_conv(
+                    L, tp, sizeof(void *), true
+                ).as<void const *>() = value;
                 return 1;
             }
             auto sz = tp.alloc_size();
-            auto &cd = newcdata(L, tp, sz);
+            auto &cd = newcdata_conv(L, tp, sz);
             std::memcpy(cd.as_ptr(), value, sz);
             return 1;
         }
@@ -559,6 +1043,87 @@ int to_lua(
     return 0;
 }
 
+/* exporting arrays into Lua dispatches on the element type only once; the
+ * values are either stored in the table at `tidx` or left on the stack
+ */
+template<typename T, int (*push)(
+    lua_State *, ast::c_type const &, void const *, bool, bool
+)>
+static void to_lua_arith(
+    lua_State *L, ast::c_type const &tp, void const *value, std::size_t n,
+    int tidx
+) {
+    auto *val = static_cast<T const *>(value);
+    for (std::size_t i = 0; i < n; ++i) {
+        push(L, tp, &val[i], false, false);
+        if (tidx) {
+            lua_rawseti(L, tidx, lua_Integer(i + 1));
+        }
+    }
+}
+
+template<typename T>
+static int push_int_elem(
+    lua_State *L, ast::c_type const &tp, void const *value, bool rv, bool lossy
+) {
+    return push_int<T>(L, tp, value, rv, lossy);
+}
+
+template<typename T>
+static int push_flt_elem(
+    lua_State *L, ast::c_type const &tp, void const *value, bool, bool lossy
+) {
+    return push_flt<T>(L, tp, value, lossy);
+}
+
+static int push_bool_elem(
+    lua_State *L, ast::c_type const &, void const *value, bool, bool
+) {
+    lua_pushboolean(L, *static_cast<bool const *>(value));
+    return 1;
+}
+
+void to_lua_array(
+    lua_State *L, ast::c_type const &tp, void const *value, std::size_t n,
+    int tidx
+) {
+    if (!tp.is_ref()) switch (tp.type()) {
+#define ARRAY_CASE(bt, T, push) \
+        case ast::C_BUILTIN_##bt: \
+            to_lua_arith<T, push>(L, tp, value, n, tidx); \
+            return;
+        ARRAY_CASE(BOOL, bool, push_bool_elem)
+        ARRAY_CASE(FLOAT, float, push_flt_elem<float>)
+        ARRAY_CASE(DOUBLE, double, push_flt_elem<double>)
+        ARRAY_CASE(LDOUBLE, long double, push_flt_elem<long double>)
+        ARRAY_CASE(CHAR, char, push_int_elem<char>)
+        ARRAY_CASE(SCHAR, signed char, push_int_elem<signed char>)
+        ARRAY_CASE(UCHAR, unsigned char, push_int_elem<unsigned char>)
+        ARRAY_CASE(SHORT, short, push_int_elem<short>)
+        ARRAY_CASE(USHORT, unsigned short, push_int_elem<unsigned short>)
+        ARRAY_CASE(INT, int, push_int_elem<int>)
+        ARRAY_CASE(UINT, unsigned int, push_int_elem<unsigned int>)
+        ARRAY_CASE(LONG, long, push_int_elem<long>)
+        ARRAY_CASE(ULONG, unsigned long, push_int_elem<unsigned long>)
+        ARRAY_CASE(LLONG, long long, push_int_elem<long long>)
+        ARRAY_CASE(ULLONG, unsigned long long, push_int_elem<unsigned long long>)
+#undef ARRAY_CASE
+        default:
+            break;
+    }
+    /* everything else is converted like when indexing */
+    auto *val = static_cast<unsigned char const *>(value);
+    auto esz = tp.alloc_size();
+    for (std::size_t i = 0; i < n; ++i) {
+        if (!to_lua(L, tp, &val[i * esz], RULE_CONV, false)) {
+            luaL_error(L, "invalid C type");
+        }
+        if (tidx) {
+            lua_rawseti(L, tidx, lua_Integer(i + 1));
+        }
+    }
+}
+
 template<typename T>
 static inline void write_int(
     lua_State *L, int index, void *stor, std::size_t &s
@@ -677,6 +1242,147 @@ static void from_lua_num(
     assert(false);
 }
 
+static int push_ptr_elem(
+    lua_State *L, ast::c_type const &tp, void const *value, bool, bool
+) {
+    push_ptr(L, tp, *static_cast<void * const *>(value));
+    return 1;
+}
+
+elem_push elem_pusher(ast::c_type const &tp) {
+    if (tp.is_ref()) {
+        return nullptr;
+    }
+    switch (tp.type()) {
+        case ast::C_BUILTIN_BOOL: return push_bool_elem;
+        case ast::C_BUILTIN_FLOAT: return push_flt_elem<float>;
+        case ast::C_BUILTIN_DOUBLE: return push_flt_elem<double>;
+        case ast::C_BUILTIN_LDOUBLE: return push_flt_elem<long double>;
+        case ast::C_BUILTIN_CHAR: return push_int_elem<char>;
+        case ast::C_BUILTIN_SCHAR: return push_int_elem<signed char>;
+        case ast::C_BUILTIN_UCHAR: return push_int_elem<unsigned char>;
+        case ast::C_BUILTIN_SHORT: return push_int_elem<short>;
+        case ast::C_BUILTIN_USHORT: return push_int_elem<unsigned short>;
+        case ast::C_BUILTIN_INT: return push_int_elem<int>;
+        case ast::C_BUILTIN_UINT: return push_int_elem<unsigned int>;
+        case ast::C_BUILTIN_LONG: return push_int_elem<long>;
+        case ast::C_BUILTIN_ULONG: return push_int_elem<unsigned long>;
+        case ast::C_BUILTIN_LLONG: return push_int_elem<long long>;
+        case ast::C_BUILTIN_ULLONG: return push_int_elem<unsigned long long>;
+        /* TODO: large enums */
+        case ast::C_BUILTIN_ENUM: return push_int_elem<int>;
+        case ast::C_BUILTIN_PTR:
+            if (tp.ptr_base().type() == ast::C_BUILTIN_FUNC) {
+                break;
+            }
+            return push_ptr_elem;
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+template<typename T>
+static bool cb_ret_int(lua_State *L, void *ret) {
+    auto vt = lua_type(L, -1);
+    if ((vt != LUA_TNUMBER) && (vt != LUA_TBOOLEAN)) {
+        return false;
+    }
+    T v;
+    std::size_t vsz;
+    write_int<T>(L, -1, &v, vsz);
+    /* libffi expects small integer results widened to a full register */
+    if (sizeof(T) >= sizeof(ffi_arg)) {
+        std::memcpy(ret, &v, sizeof(T));
+    } else if (util::is_signed<T>::value) {
+        *static_cast<ffi_sarg *>(ret) = ffi_sarg(v);
+    } else {
+        *static_cast<ffi_arg *>(ret) = ffi_arg(v);
+    }
+    return true;
+}
+
+template<typename T>
+static bool cb_ret_flt(lua_State *L, void *ret) {
+    auto vt = lua_type(L, -1);
+    if ((vt != LUA_TNUMBER) && (vt != LUA_TBOOLEAN)) {
+        return false;
+    }
+    std::size_t vsz;
+    write_flt<T>(L, -1, ret, vsz);
+    return true;
+}
+
+static cb_ret cb_retter(ast::c_type const &tp) {
+    if (tp.is_ref()) {
+        return nullptr;
+    }
+    switch (tp.type()) {
+        case ast::C_BUILTIN_BOOL: return cb_ret_int<bool>;
+        case ast::C_BUILTIN_FLOAT: return cb_ret_flt<float>;
+        case ast::C_BUILTIN_DOUBLE: return cb_ret_flt<double>;
+        case ast::C_BUILTIN_LDOUBLE: return cb_ret_flt<long double>;
+        case ast::C_BUILTIN_CHAR: return cb_ret_int<char>;
+        case ast::C_BUILTIN_SCHAR: return cb_ret_int<signed char>;
+        case ast::C_BUILTIN_UCHAR: return cb_ret_int<unsigned char>;
+        case ast::C_BUILTIN_SHORT: return cb_ret_int<short>;
+        case ast::C_BUILTIN_USHORT: return cb_ret_int<unsigned short>;
+        case ast::C_BUILTIN_INT: return cb_ret_int<int>;
+        case ast::C_BUILTIN_UINT: return cb_ret_int<unsigned int>;
+        case ast::C_BUILTIN_LONG: return cb_ret_int<long>;
+        case ast::C_BUILTIN_ULONG: return cb_ret_int<unsigned long>;
+        case ast::C_BUILTIN_LLONG: return cb_ret_int<long long>;
+        case ast::C_BUILTIN_ULLONG: return cb_ret_int<unsigned long long>;
+        /* TODO: large enums */
+        case ast::C_BUILTIN_ENUM: return cb_ret_int<int>;
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+/* callbacks taking only scalars, which covers the typical comparators and
+ * visitors, skip the type dispatch of to_lua on every call
+ */
+static bool prepare_cb_fast(lua_State *L, closure_data &cd) {
+    auto &pars = cd.func->params();
+    auto *cargs = cd.cb_args();
+    for (std::size_t i = 0; i < pars.size(); ++i) {
+        cargs[i].push = elem_pusher(pars[i].type());
+        if (!cargs[i].push) {
+            return false;
+        }
+        cargs[i].type = intern(L, pars[i].type());
+    }
+    cd.ret = cb_retter(cd.func->result());
+    return true;
+}
+
+static void cb_bind_fast(ffi_cif *, void *ret, void *args[], void *data) {
+    closure_data &cd = *static_cast<closure_data *>(data);
+    auto *L = cd.L;
+    auto nargs = cd.cif.nargs;
+    auto *cargs = cd.cb_args();
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cd.fref);
+    for (std::size_t i = 0; i < nargs; ++i) {
+        cargs[i].push(L, *cargs[i].type, args[i], false, false);
+    }
+
+    if (cd.func->result().type() == ast::C_BUILTIN_VOID) {
+        lua_call(L, int(nargs), 0);
+        return;
+    }
+    lua_call(L, int(nargs), 1);
+    if (!cd.ret || !cd.ret(L, ret)) {
+        ffi::scalar_stor_t stor{};
+        std::size_t rsz;
+        void *rp = from_lua(L, cd.func->result(), &stor, -1, rsz, RULE_RET);
+        std::memcpy(ret, rp, rsz);
+    }
+    lua_pop(L, 1);
+}
+
 static inline bool cv_convertible(int scv, int tcv) {
     if (!(tcv & ast::C_CV_CONST) && (scv & ast::C_CV_CONST)) {
         return false;
@@ -1051,7 +1757,7 @@ static void *from_lua(
             if (iscdata(L, index)) {
                 auto &cd = *lua::touserdata<cdata>(L, index);
                 return from_lua_cdata(
-                    L, cd.decl, tp, cd.as_ptr(), stor, dsz, rule
+                    L, *cd.decl, tp, cd.as_ptr(), stor, dsz, rule
                 );
             }
             auto tpt = tp.type();
@@ -1178,6 +1884,75 @@ fallback:
     std::memcpy(val, vp, vsz);
 }
 
+template<typename T>
+static inline T table_int(lua_State *L) {
+    if (lua_isinteger(L, -1)) {
+        return T(lua_tointeger(L, -1));
+    }
+    return T(lua_tonumber(L, -1));
+}
+
+template<typename T>
+static inline T table_flt(lua_State *L) {
+    return T(lua_tonumber(L, -1));
+}
+
+/* converting tables of numbers into arithmetic arrays is common enough
+ * that it should not dispatch on the element type for every element; only
+ * values that are not plain numbers go through the generic conversion
+ */
+template<typename T, T (*conv)(lua_State *)>
+static void from_lua_table_arith(
+    lua_State *L, ast::c_type const &pb, void *stor, int tidx, int sidx,
+    int ninit
+) {
+    auto *val = static_cast<T *>(stor);
+    for (int i = 0; i < ninit; ++i) {
+        lua_rawgeti(L, tidx, sidx + i);
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            val[i] = conv(L);
+        } else {
+            from_lua_str(L, pb, &val[i], sizeof(T), -1);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+/* returns false if the element type has no bulk path */
+static bool from_lua_table_bulk(
+    lua_State *L, ast::c_type const &pb, void *stor, int tidx, int sidx,
+    int ninit
+) {
+    if (pb.is_ref()) {
+        return false;
+    }
+    switch (pb.type()) {
+#define BULK_CASE(bt, T, conv) \
+        case ast::C_BUILTIN_##bt: \
+            from_lua_table_arith<T, conv<T>>(L, pb, stor, tidx, sidx, ninit); \
+            return true;
+        BULK_CASE(FLOAT, float, table_flt)
+        BULK_CASE(DOUBLE, double, table_flt)
+        BULK_CASE(LDOUBLE, long double, table_flt)
+        BULK_CASE(BOOL, bool, table_int)
+        BULK_CASE(CHAR, char, table_int)
+        BULK_CASE(SCHAR, signed char, table_int)
+        BULK_CASE(UCHAR, unsigned char, table_int)
+        BULK_CASE(SHORT, short, table_int)
+        BULK_CASE(USHORT, unsigned short, table_int)
+        BULK_CASE(INT, int, table_int)
+        BULK_CASE(UINT, unsigned int, table_int)
+        BULK_CASE(LONG, long, table_int)
+        BULK_CASE(ULONG, unsigned long, table_int)
+        BULK_CASE(LLONG, long long, table_int)
+        BULK_CASE(ULLONG, unsigned long long, table_int)
+#undef BULK_CASE
+        default:
+            break;
+    }
+    return false;
+}
+
 static void from_lua_table_record(
     lua_State *L, ast::c_type const &decl, void *stor, std::size_t rsz,
     int tidx, int sidx, int ninit
@@ -1250,6 +2025,30 @@ static void from_lua_table_record(
     }
 }
 
+/* initializes `ninit` consecutive elements of type `pb` */
+static void from_lua_table_elems(
+    lua_State *L, ast::c_type const &pb, void *stor, int tidx, int sidx,
+    int ninit
+) {
+    if (tidx && from_lua_table_bulk(L, pb, stor, tidx, sidx, ninit)) {
+        return;
+    }
+    auto *val = static_cast<unsigned char *>(stor);
+    auto bsize = pb.alloc_size();
+    bool base_array = (pb.type() == ast::C_BUILTIN_ARRAY);
+    bool base_struct = (pb.type() == ast::C_BUILTIN_RECORD);
+    for (int rinit = ninit; rinit; --rinit) {
+        push_init(L, tidx, sidx++);
+        if ((base_array || base_struct) && lua_istable(L, -1)) {
+            from_lua_table(L, pb, val, bsize, -1);
+        } else {
+            from_lua_str(L, pb, val, bsize, -1);
+        }
+        val += bsize;
+        lua_pop(L, 1);
+    }
+}
+
 /* this can't be done in from_lua, because when from_lua is called, the
  * memory is not allocated yet... so do it here, as a special case
  */
@@ -1274,24 +2073,13 @@ static void from_lua_table(
     auto nelems = rsz / bsize;
     auto flex = decl.flex();
 
-    bool base_array = (pb.type() == ast::C_BUILTIN_ARRAY);
-    bool base_struct = (pb.type() == ast::C_BUILTIN_RECORD);
-
     if (!flex && (ninit > int(nelems))) {
         luaL_error(L, "too many initializers");
         return;
     }
 
-    for (int rinit = ninit; rinit; --rinit) {
-        push_init(L, tidx, sidx++);
-        if ((base_array || base_struct) && lua_istable(L, -1)) {
-            from_lua_table(L, pb, val, bsize, -1);
-        } else {
-            from_lua_str(L, pb, val, bsize, -1);
-        }
-        val += bsize;
-        lua_pop(L, 1);
-    }
+    from_lua_table_elems(L, pb, val, tidx, sidx, ninit);
+    val += bsize * std::size_t(ninit);
     if (!flex && (ninit == 1)) {
         /* special case: initialize aggregate with a single value
          *
@@ -1354,7 +2142,7 @@ static bool from_lua_aggreg(
                 if (iscdata(L, idx)) {
                     /* got cdata as initializer */
                     auto &cd = *lua::touserdata<cdata>(L, idx);
-                    if (cd.decl.is_same(decl, true, true)) {
+                    if (cd.decl->is_same(decl, true, true)) {
                         /* it's a compatible type: do a copy */
                         std::size_t vsz;
                         ffi::scalar_stor_t sv{};
@@ -1400,9 +2188,9 @@ static bool from_lua_aggreg(
      */
     if (!decl.vla() && iscdata(L, idx)) {
         auto &cd = *lua::touserdata<cdata>(L, idx);
-        if (cd.decl.is_same(decl, true, true) || (
-            carr && cd.decl.ptr_base().byte() &&
-            (cd.decl.array_size() == decl.array_size())
+        if (cd.decl->is_same(decl, true, true) || (
+            carr && cd.decl->ptr_base().byte() &&
+            (cd.decl->array_size() == decl.array_size())
         )) {
             /* exact copy by value */
             std::memcpy(stor, *static_cast<void **>(cd.as_deref_ptr()), msz);
@@ -1414,6 +2202,19 @@ static bool from_lua_aggreg(
     return true;
 }
 
+void from_lua_array(
+    lua_State *L, ast::c_type const &tp, void *stor, int tidx,
+    std::size_t nelems
+) {
+    if (tp.cv() & ast::C_CV_CONST) {
+        luaL_error(L, "attempt to write to constant location");
+    }
+    if (nelems > std::size_t(util::limit_max<int>())) {
+        luaL_error(L, "too many elements");
+    }
+    from_lua_table_elems(L, tp, stor, tidx, 1, int(nelems));
+}
+
 void from_lua(lua_State *L, ast::c_type const &decl, void *stor, int idx) {
     if (decl.cv() & ast::C_CV_CONST) {
         luaL_error(L, "attempt to write to constant location");
@@ -1439,6 +2240,37 @@ void from_lua(lua_State *L, ast::c_type const &decl, void *stor, int idx) {
     }
 }
 
+/* function cdata are never modified after creation, so the same object
+ * can be handed out for every lookup through a library namespace; they
+ * are kept in the per-library symbol cache, keyed by their declaration,
+ * so that a different declaration for the same name never gets a stale
+ * object (the function type identity is checked as well)
+ */
+static void get_global_func(
+    lua_State *L, lib::c_lib const *dl, ast::c_variable const &var
+) {
+    auto *key = const_cast<ast::c_variable *>(&var);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dl->cache);
+    lua_pushlightuserdata(L, key);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)) {
+        auto &cd = tocdata(L, -1);
+        if (cd.decl->function().get() == var.type().function().get()) {
+            lua_replace(L, -2);
+            return;
+        }
+    }
+    lua_pop(L, 1);
+    void *symp = lib::get_sym(dl, L, var.sym());
+    make_cdata_func(
+        L, util::pun<void (*)()>(symp), var.type().function(), false, nullptr
+    );
+    lua_pushlightuserdata(L, key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    lua_replace(L, -2);
+}
+
 void get_global(lua_State *L, lib::c_lib const *dl, const char *sname) {
     auto &ds = ast::decl_store::get_main(L);
     auto const *decl = ds.lookup(sname);
@@ -1451,15 +2283,13 @@ void get_global(lua_State *L, lib::c_lib const *dl, const char *sname) {
     switch (tp) {
         case ast::c_object_type::VARIABLE: {
             auto &var = decl->as<ast::c_variable>();
-            void *symp = lib::get_sym(dl, L, var.sym());
             if (var.type().type() == ast::C_BUILTIN_FUNC) {
-                make_cdata_func(
-                    L, util::pun<void (*)()>(symp), var.type().function(),
-                    false, nullptr
-                );
-            } else {
-                to_lua(L, var.type(), symp, RULE_RET, false);
+                get_global_func(L, dl, var);
+                return;
             }
+            to_lua(
+                L, var.type(), lib::get_sym(dl, L, var.sym()), RULE_RET, false
+            );
             return;
         }
         case ast::c_object_type::CONSTANT: {
@@ -1492,18 +2322,18 @@ void set_global(lua_State *L, lib::c_lib const *dl, char const *sname, int idx)
     from_lua(L, cv.type(), lib::get_sym(dl, L, cv.sym()), idx);
 }
 
-void make_cdata(lua_State *L, ast::c_type const &decl, int rule, int idx) {
-    switch (decl.type()) {
-        case ast::C_BUILTIN_FUNC:
-            luaL_error(L, "invalid C type");
-            break;
-        default:
-            break;
-    }
+/* the size and initializers of a new cdata value, see make_cdata */
+struct cdata_init {
     ffi::scalar_stor_t stor{};
     void *cdp = nullptr;
     std::size_t rsz = 0, narr = 0;
-    int iidx = idx, ninits;
+    int iidx, ninits;
+};
+
+static void cdata_init_get(
+    lua_State *L, ast::c_type const &decl, int rule, int idx, cdata_init &ci
+) {
+    ci.iidx = idx;
     if (rule == RULE_CAST) {
         goto definit;
     }
@@ -1513,19 +2343,19 @@ void make_cdata(lua_State *L, ast::c_type const &decl, int rule, int idx) {
             if (arrs < 0) {
                 luaL_error(L, "size of C type is unknown");
             }
-            ++iidx;
-            ninits = lua_gettop(L) - iidx + 1;
-            narr = std::size_t(arrs);
-            rsz = decl.ptr_base().alloc_size() * narr;
+            ++ci.iidx;
+            ci.ninits = lua_gettop(L) - ci.iidx + 1;
+            ci.narr = std::size_t(arrs);
+            ci.rsz = decl.ptr_base().alloc_size() * ci.narr;
             /* see below */
-            rsz += sizeof(ffi::scalar_stor_t);
-            goto newdata;
+            ci.rsz += sizeof(ffi::scalar_stor_t);
+            return;
         } else if (decl.flex()) {
             luaL_error(L, "size of C type is unknown");
         }
-        ninits = lua_gettop(L) - iidx + 1;
-        narr = decl.array_size();
-        rsz = decl.ptr_base().alloc_size() * narr;
+        ci.ninits = lua_gettop(L) - ci.iidx + 1;
+        ci.narr = decl.array_size();
+        ci.rsz = decl.ptr_base().alloc_size() * ci.narr;
         /* owned arrays consist of an ffi::scalar_stor_t part, which is an
          * ffi::scalar_stor_t because that has the greatest alignment of all
          * scalars and thus is good enough to follow up with any type after
@@ -1533,8 +2363,8 @@ void make_cdata(lua_State *L, ast::c_type const &decl, int rule, int idx) {
          * pointer to the array part right in the beginning, so we can freely
          * cast between any array and a pointer, even an owned one
          */
-        rsz += sizeof(ffi::scalar_stor_t);
-        goto newdata;
+        ci.rsz += sizeof(ffi::scalar_stor_t);
+        return;
     } else if (decl.type() == ast::C_BUILTIN_RECORD) {
         ast::c_type const *lf = nullptr;
         if (decl.record().flexible(&lf)) {
@@ -1542,92 +2372,153 @@ void make_cdata(lua_State *L, ast::c_type const &decl, int rule, int idx) {
             if (arrs < 0) {
                 luaL_error(L, "size of C type is unknown");
             }
-            ++iidx;
-            ninits = lua_gettop(L) - iidx + 1;
-            rsz = decl.alloc_size() + (
+            ++ci.iidx;
+            ci.ninits = lua_gettop(L) - ci.iidx + 1;
+            ci.rsz = decl.alloc_size() + (
                 std::size_t(arrs) * lf->ptr_base().alloc_size()
             );
-            goto newdata;
+            return;
         }
-        ninits = lua_gettop(L) - iidx + 1;
-        rsz = decl.alloc_size();
-        goto newdata;
+        ci.ninits = lua_gettop(L) - ci.iidx + 1;
+        ci.rsz = decl.alloc_size();
+        return;
     }
 definit:
-    ninits = lua_gettop(L) - iidx + 1;
-    if (ninits > 1) {
+    ci.ninits = lua_gettop(L) - ci.iidx + 1;
+    if (ci.ninits > 1) {
         luaL_error(L, "too many initializers");
-    } else if (ninits == 1) {
-        cdp = from_lua(L, decl, &stor, idx, rsz, rule);
+    } else if (ci.ninits == 1) {
+        ci.cdp = from_lua(L, decl, &ci.stor, idx, ci.rsz, rule);
     } else {
-        rsz = decl.alloc_size();
+        ci.rsz = decl.alloc_size();
     }
-newdata:
+}
+
+/* initializes the value memory of a non-callable cdata */
+static void cdata_init_value(
+    lua_State *L, ast::c_type const &decl, void *val, cdata_init &ci
+) {
+    void *dptr = nullptr;
+    std::size_t msz = ci.rsz;
+    if (!ci.cdp) {
+        std::memset(val, 0, ci.rsz);
+        if (decl.type() == ast::C_BUILTIN_ARRAY) {
+            auto *bval = static_cast<unsigned char *>(val);
+            dptr = bval + sizeof(ffi::scalar_stor_t);
+            *static_cast<void **>(val) = dptr;
+            msz = ci.rsz - sizeof(ffi::scalar_stor_t);
+        } else {
+            dptr = val;
+        }
+    } else if (decl.type() == ast::C_BUILTIN_ARRAY) {
+        std::size_t esz = (ci.rsz - sizeof(ffi::scalar_stor_t)) / ci.narr;
+        /* the base of the alloated block */
+        auto *bval = static_cast<unsigned char *>(val);
+        /* the array memory begins after the first ffi::scalar_stor_t */
+        auto *aval = bval + sizeof(ffi::scalar_stor_t);
+        dptr = aval;
+        /* we can treat an array like a pointer, always */
+        *static_cast<void **>(val) = dptr;
+        /* write initializers into the array part */
+        for (std::size_t i = 0; i < ci.narr; ++i) {
+            std::memcpy(&aval[i * esz], ci.cdp, esz);
+        }
+        msz = ci.rsz - sizeof(ffi::scalar_stor_t);
+    } else {
+        dptr = val;
+        std::memcpy(dptr, ci.cdp, ci.rsz);
+    }
+    /* perform aggregate initialization */
+    from_lua_aggreg(L, decl, dptr, msz, ci.ninits, ci.iidx);
+}
+
+void make_cdata(lua_State *L, ast::c_type const &decl, int rule, int idx) {
+    switch (decl.type()) {
+        case ast::C_BUILTIN_FUNC:
+            luaL_error(L, "invalid C type");
+            break;
+        default:
+            break;
+    }
+    cdata_init ci;
+    cdata_init_get(L, decl, rule, idx, ci);
     if (decl.callable()) {
         closure_data *cd = nullptr;
-        if (cdp && iscdata(L, idx)) {
+        if (ci.cdp && iscdata(L, idx)) {
             /* special handling for closures */
             auto &fcd = tocdata(L, idx);
-            if (fcd.decl.closure()) {
+            if (fcd.decl->closure()) {
                 cd = fcd.as<fdata>().cd;
-                cdp = nullptr;
+                ci.cdp = nullptr;
             }
         }
         void (*symp)() = nullptr;
-        if (cdp) {
-            std::memcpy(&symp, cdp, sizeof(symp));
+        if (ci.cdp) {
+            std::memcpy(&symp, ci.cdp, sizeof(symp));
         }
         make_cdata_func(
             L, symp, decl.function(), decl.type() == ast::C_BUILTIN_PTR, cd
         );
-        if (!cdp && !cd) {
-            tocdata(L, -1).as<fdata>().cd->fref = util::pun<int>(stor);
+        if (!ci.cdp && !cd) {
+            tocdata(L, -1).as<fdata>().cd->fref = util::pun<int>(ci.stor);
         }
     } else {
-        auto &cd = newcdata(L, decl, rsz);
-        void *dptr = nullptr;
-        std::size_t msz = rsz;
-        if (!cdp) {
-            std::memset(cd.as_ptr(), 0, rsz);
-            if (decl.type() == ast::C_BUILTIN_ARRAY) {
-                auto *bval = static_cast<unsigned char *>(cd.as_ptr());
-                dptr = bval + sizeof(ffi::scalar_stor_t);
-                cd.as<void *>() = dptr;
-                msz = rsz - sizeof(ffi::scalar_stor_t);
-            } else {
-                dptr = cd.as_ptr();
-            }
-        } else if (decl.type() == ast::C_BUILTIN_ARRAY) {
-            std::size_t esz = (rsz - sizeof(ffi::scalar_stor_t)) / narr;
-            /* the base of the alloated block */
-            auto *bval = static_cast<unsigned char *>(cd.as_ptr());
-            /* the array memory begins after the first ffi::scalar_stor_t */
-            auto *val = bval + sizeof(ffi::scalar_stor_t);
-            dptr = val;
-            /* we can treat an array like a pointer, always */
-            cd.as<void *>() = dptr;
-            /* write initializers into the array part */
-            for (std::size_t i = 0; i < narr; ++i) {
-                std::memcpy(&val[i * esz], cdp, esz);
-            }
-            msz = rsz - sizeof(ffi::scalar_stor_t);
-        } else {
-            dptr = cd.as_ptr();
-            std::memcpy(dptr, cdp, rsz);
-        }
-        /* perform aggregate initialization */
-        from_lua_aggreg(L, decl, dptr, msz, ninits, iidx);
+        auto &cd = newcdata(L, decl, ci.rsz);
+        cdata_init_value(L, decl, cd.as_ptr(), ci);
         /* set a gc finalizer if provided in metatype */
         if (decl.type() == ast::C_BUILTIN_RECORD) {
             int mf;
             int mt = decl.record().metatype(mf);
             if (mf & METATYPE_FLAG_GC) {
                 if (metatype_getfield(L, mt, "__gc")) {
-                    cd.gc_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+                    set_finalizer(L, lua_gettop(L) - 1, lua_gettop(L));
+                    lua_pop(L, 1);
                 }
             }
         }
     }
 }
 
+void make_cdata_arena(
+    lua_State *L, arena &ar, ast::c_type const &decl, int idx
+) {
+    if (decl.callable() || (decl.type() == ast::C_BUILTIN_VOID)) {
+        luaL_error(L, "invalid C type");
+    }
+    cdata_init ci;
+    cdata_init_get(L, decl, RULE_CONV, idx, ci);
+    auto *val = ar.alloc(ci.rsz);
+    if (!val) {
+        luaL_error(L, "not enough memory");
+    }
+    cdata_init_value(L, decl, val, ci);
+    if (decl.type() == ast::C_BUILTIN_RECORD) {
+        /* structs and unions are handed out as references */
+        newcdata(
+            L, *intern_ref(L, decl), sizeof(void *)
+        ).as<void *>() = val;
+        return;
+    } else if (decl.type() != ast::C_BUILTIN_ARRAY) {
+        /* and scalars as pointers, like array elements */
+        auto &ptp = ast::decl_store::get_main(L).ptr_to(decl);
+        newcdata(L, ptp, sizeof(void *)).as<void *>() = val;
+        return;
+    }
+    /* arrays only hold the pointer to their memory, so an array cdata can
+     * point into the arena just as well; the size of a variable length
+     * array cannot be derived from the handle then, so it is stored in it
+     */
+    void *aval = *static_cast<void **>(val);
+    if (decl.vla()) {
+        auto &cd = newcdata(L, decl, sizeof(void *) + sizeof(std::size_t));
+        cd.flags |= CDATA_VLASIZE;
+        auto *hval = static_cast<unsigned char *>(cd.as_ptr());
+        std::size_t asz = ci.rsz - sizeof(ffi::scalar_stor_t);
+        std::memcpy(hval, &aval, sizeof(void *));
+        std::memcpy(hval + sizeof(void *), &asz, sizeof(asz));
+    } else {
+        newcdata(L, decl, sizeof(void *)).as<void *>() = aval;
+    }
+}
+
 } /* namespace ffi */
@@ -120,30 +120,35 @@ static_assert((
     (util::is_float<lua_Number>::value || util::is_int<lua_Number>::value)
 ), "unsupported lua_Number type");
 
-struct cdata {
-    ast::c_type decl;
-    int gc_ref;
-    /* auxiliary data that can be used by different cdata
-     *
-     * vararg functions store the number of arguments they have storage
-     * prepared for here to avoid reallocating every time
-     */
-    int aux;
+enum cdata_flags {
+    CDATA_CTYPE = 1 << 0, /* a ctype rather than a value */
+    CDATA_FINALIZER = 1 << 1, /* has an entry in the finalizer table */
+    CDATA_OVERALIGNED = 1 << 2, /* the value needs extra alignment */
+    CDATA_OWNDECL = 1 << 3, /* holds a reference to a shared type */
+    CDATA_VLASIZE = 1 << 4, /* a VLA size follows the pointer to its memory */
+    CDATA_CLOSURE = 1 << 5, /* a callback handle counted by its closure */
+};
 
-    template<typename D>
-    cdata(D &&tp): decl{util::forward<D>(tp)} {}
+/* the type is typically the interned instance from the main declaration
+ * store, so creating cdata involves no copying and cdata never need to
+ * release it; types the store does not keep are shared copies, which the
+ * cdata holds a reference to until it is finalized (see decl_store::find);
+ * finalizers are rare, so they are kept out of line in a registry table
+ */
+struct cdata {
+    ast::c_type const *decl;
+    std::uint32_t flags;
 
-    /* we always allocate enough userdata so that after the regular fields
-     * of struct cdata, there is a data section, with enough space so that
-     * the requested type can fit aligned to maximum scalar alignment we are
-     * storing
-     *
-     * this is important, because lua_newuserdata may return misaligned pointers
-     * (it only guarantees alignment of typically 8, while we typically need 16)
-     * so we have to overallocate by a bit, then manually align the data
+    /* the value immediately follows the header, which is what lua aligns
+     * userdata to; lua_newuserdata only guarantees alignment of typically
+     * 8, so for the few types which need more (e.g. long double) we have
+     * to overallocate by a bit, then manually align the data
      */
     void *as_ptr() {
-        return util::ptr_align(this + 1);
+        if (flags & CDATA_OVERALIGNED) {
+            return util::ptr_align(this + 1);
+        }
+        return this + 1;
     }
 
     template<typename T>
@@ -152,7 +157,7 @@ struct cdata {
     }
 
     void *as_deref_ptr() {
-        if (decl.is_ref()) {
+        if (decl->is_ref()) {
             return as<void *>();
         }
         return as_ptr();
@@ -164,43 +169,93 @@ struct cdata {
     }
 
     void *address_of() {
-        if (decl.ptr_like()) {
+        if (decl->ptr_like()) {
             return as<void *>();
         }
         return as_deref_ptr();
     }
 };
 
+/* ctypes share the header, but have no value */
 struct ctype {
-    ast::c_type decl;
-    int ct_tag;
-
-    template<typename D>
-    ctype(D &&tp): decl{util::forward<D>(tp)} {}
+    ast::c_type const *decl;
+    std::uint32_t flags;
 };
 
-inline constexpr std::size_t cdata_pad_size() {
-    auto csz = sizeof(cdata);
-    auto mod = (csz % alignof(lua::user_align_t));
-    /* size in multiples of lua userdata alignment */
-    if (mod) {
-        csz += alignof(lua::user_align_t) - mod;
-    }
-    /* this should typically not happen, unless configured that way */
-    if (alignof(lua::user_align_t) >= alignof(util::max_aligned_t)) {
-        return csz;
-    }
-    /* add the difference for internal alignment */
-    csz += (alignof(util::max_aligned_t) - alignof(lua::user_align_t));
-    /* this is what we will allocate, plus the data size */
-    return csz;
+static_assert(
+    (sizeof(cdata) % alignof(lua::user_align_t)) == 0,
+    "cdata header must keep the value aligned"
+);
+
+/* the extra space needed to align overaligned values */
+inline constexpr std::size_t cdata_align_pad() {
+    return (alignof(lua::user_align_t) >= alignof(util::max_aligned_t))
+        ? 0 : (alignof(util::max_aligned_t) - alignof(lua::user_align_t));
+}
+
+/* whether values of the type need more alignment than userdata have */
+static inline bool cdata_overaligned(ast::c_type const &tp) {
+    if (!cdata_align_pad() || tp.is_ref()) {
+        return false;
+    }
+    auto const *vt = &tp;
+    /* owned arrays are aligned like their elements */
+    while (vt->type() == ast::C_BUILTIN_ARRAY) {
+        vt = &vt->ptr_base();
+    }
+    switch (vt->type()) {
+        case ast::C_BUILTIN_PTR:
+        case ast::C_BUILTIN_FUNC:
+            return false;
+        default:
+            break;
+    }
+    return vt->libffi_type()->alignment > alignof(lua::user_align_t);
 }
 
+/* converters of scalars, chosen once for callbacks taking only scalar
+ * arguments and for array iterators; a result converter returns false for
+ * values that need the generic conversion
+ */
+using elem_push = int (*)(
+    lua_State *, ast::c_type const &, void const *, bool, bool
+);
+using cb_ret = bool (*)(lua_State *, void *);
+
+struct cb_arg {
+    elem_push push;
+    ast::c_type const *type; /* interned, for the cdata it may create */
+};
+
 struct closure_data {
     ffi_cif cif; /* closure data needs its own cif */
     int fref = LUA_REFNIL;
     lua_State *L = nullptr;
     ffi_closure *closure = nullptr;
+    /* the interned signature, which also identifies the pool it goes to */
+    ast::c_function const *func = nullptr;
+    ast::c_type const *decl = nullptr; /* the type of the first handle */
+    void (*sym)() = nullptr; /* the code address of the closure */
+    closure_data *next = nullptr; /* within a pool */
+    cb_ret ret = nullptr; /* null if not a scalar, see cb_bind_fast */
+    std::size_t nhandles = 0; /* the handles that refer to it */
+    bool freed = false; /* released by one of them, see release_closure */
+
+    /* MEMORY LAYOUT:
+     *
+     * struct closure_data {
+     *     <closure_data header>
+     *     ffi_type *argN; // cif argument types
+     *     cb_arg argN;    // argument converters
+     * }
+     */
+    ffi_type **types() {
+        return util::pun<ffi_type **>(this + 1);
+    }
+
+    cb_arg *cb_args() {
+        return util::pun<cb_arg *>(types() + cif.nargs);
+    }
 
     ~closure_data() {
         if (!closure) {
@@ -211,77 +266,224 @@ struct closure_data {
     }
 };
 
+/* closures of freed callbacks are kept prepared for their signature, so
+ * that a new callback of the same type only has to reference its function;
+ * the number of pooled closures in a state is bounded
+ */
+static constexpr std::size_t CLOSURE_POOL_MAX = 64;
+
+struct closure_pool {
+    struct func_hash {
+        std::size_t operator()(ast::c_function const *f) const {
+            auto h = util::pun<std::uintptr_t>(f);
+            return std::size_t(h ^ (h >> 9));
+        }
+    };
+
+    struct func_equal {
+        bool operator()(
+            ast::c_function const *f1, ast::c_function const *f2
+        ) const {
+            return f1 == f2;
+        }
+    };
+
+    util::map<ast::c_function const *, closure_data *, func_hash, func_equal>
+        free;
+    std::size_t count = 0;
+    std::size_t max = CLOSURE_POOL_MAX;
+};
+
+/* direct call path for a specific signature, bypassing libffi */
+using fast_tramp = void (*)(void (*sym)(), void **args, void *rval);
+
+/* a prepared cif for one particular sequence of vararg types; the argument
+ * type array is not kept here, calls supply their own when reusing it
+ */
+static constexpr std::size_t VARARG_CIF_ARGS = 8;
+static constexpr std::size_t VARARG_CIF_SLOTS = 4;
+
+struct vararg_cif {
+    ffi_cif cif;
+    std::size_t nargs; /* 0 if the slot is unused */
+    ffi_type *types[VARARG_CIF_ARGS];
+};
+
+struct vararg_cache {
+    std::size_t next; /* the slot to replace next */
+    vararg_cif slots[VARARG_CIF_SLOTS];
+};
+
 /* data used for function types */
 struct fdata {
     void (*sym)();
     closure_data *cd; /* only for callbacks, otherwise nullptr */
+    fast_tramp fast; /* nullptr if calls must go through libffi */
     ffi_cif cif;
-    ffi::scalar_stor_t rarg;
 
-    ffi::scalar_stor_t *args() {
-        return util::pun<ffi::scalar_stor_t *>(this + 1);
+    /* argument types of non-variadic functions, used by the cif */
+    ffi_type **types() {
+        return util::pun<ffi_type **>(this + 1);
+    }
+
+    /* prepared cifs of variadic functions, used instead of types() */
+    vararg_cache &vcache() {
+        return *util::pun<vararg_cache *>(this + 1);
     }
 };
 
-static inline cdata &newcdata(
+/* a bump allocator for cdata values which are all released at once; the
+ * memory comes in chunks, and the most recent one is kept when resetting
+ * so that a reused arena typically does not allocate at all
+ */
+struct arena {
+    struct chunk {
+        chunk *next;
+        std::size_t size;
+
+        unsigned char *data() {
+            return static_cast<unsigned char *>(util::ptr_align(this + 1));
+        }
+    };
+
+    chunk *chunks = nullptr;
+    std::size_t used = 0;
+    std::size_t csize;
+
+    arena(std::size_t initsz): csize{initsz} {}
+
+    ~arena() {
+        release(chunks);
+    }
+
+    /* null if the memory cannot be had */
+    void *alloc(std::size_t sz);
+
+    void reset() {
+        if (chunks) {
+            release(chunks->next);
+            chunks->next = nullptr;
+        }
+        used = 0;
+    }
+
+private:
+    static void release(chunk *ch);
+};
+
+/* the interned instance of a type, without looking up the store if the
+ * type is interned already; only for types coming from declarations
+ */
+static inline ast::c_type const *intern(lua_State *L, ast::c_type const &tp) {
+    if (tp.interned()) {
+        return &tp;
+    }
+    return &ast::decl_store::get_main(L).intern(tp);
+}
+
+/* the instance of a type that values can use, see decl_store::find */
+static inline ast::c_type const *find_decl(
+    lua_State *L, ast::c_type const &tp
+) {
+    if (tp.interned() || tp.shared()) {
+        return &tp;
+    }
+    return &ast::decl_store::get_main(L).find(tp);
+}
+
+static inline ast::c_type const *intern_ref(
+    lua_State *L, ast::c_type const &tp
+) {
+    if (tp.interned_ref()) {
+        return tp.interned_ref();
+    }
+    return &ast::decl_store::get_main(L).ref_to(tp);
+}
+
+/* the type is looked up after the userdata is made, so that a shared type
+ * always ends up referenced
+ */
+static inline cdata &newcdata_raw(
     lua_State *L, ast::c_type const &tp, std::size_t vals
 ) {
-    auto ssz = cdata_pad_size() + vals;
-    auto *cd = static_cast<cdata *>(lua_newuserdata(L, ssz));
-    new (cd) cdata{tp.copy()};
-    cd->gc_ref = LUA_REFNIL;
-    cd->aux = 0;
-    lua::mark_cdata(L);
+    std::uint32_t flags = 0;
+    if (cdata_overaligned(tp)) {
+        vals += cdata_align_pad();
+        flags = CDATA_OVERALIGNED;
+    }
+    auto *cd = static_cast<cdata *>(lua_newuserdata(L, sizeof(cdata) + vals));
+    cd->decl = find_decl(L, tp);
+    if (cd->decl->shared()) {
+        cd->decl->acquire();
+        flags |= CDATA_OWNDECL;
+    }
+    cd->flags = flags;
     return *cd;
 }
 
-template<typename ...A>
-static inline ctype &newctype(lua_State *L, A &&...args) {
+/* cdata are created without a finalizer, which most never need, so the
+ * collector can free them right away; setting one with cffi.gc or through
+ * a metatype switches the cdata to the finalized metatable, and so does
+ * holding a shared type, which is released when finalizing
+ */
+static inline cdata &newcdata(
+    lua_State *L, ast::c_type const &tp, std::size_t vals
+) {
+    auto &cd = newcdata_raw(L, tp, vals);
+    if (cd.flags & CDATA_OWNDECL) {
+        lua::mark_cdata(L);
+    } else {
+        lua::mark_cdata_light(L);
+    }
+    return cd;
+}
+
+static inline ctype &newctype(lua_State *L, ast::c_type const &tp) {
     auto *cd = static_cast<ctype *>(lua_newuserdata(L, sizeof(ctype)));
-    new (cd) ctype{ast::c_type{util::forward<A>(args)...}};
-    cd->ct_tag = lua::CFFI_CTYPE_TAG;
-    lua::mark_cdata(L);
+    cd->decl = find_decl(L, tp);
+    cd->flags = CDATA_CTYPE;
+    if (cd->decl->shared()) {
+        cd->decl->acquire();
+        cd->flags |= CDATA_OWNDECL;
+        lua::mark_cdata(L);
+    } else {
+        lua::mark_cdata_light(L);
+    }
     return *cd;
 }
 
 static inline bool iscdata(lua_State *L, int idx) {
-    auto *p = static_cast<ctype *>(luaL_testudata(L, idx, lua::CFFI_CDATA_MT));
-    return p && (p->ct_tag != lua::CFFI_CTYPE_TAG);
+    auto *p = static_cast<ctype *>(lua::testcdata(L, idx));
+    return p && !(p->flags & CDATA_CTYPE);
 }
 
 static inline bool isctype(lua_State *L, int idx) {
-    auto *p = static_cast<ctype *>(luaL_testudata(L, idx, lua::CFFI_CDATA_MT));
-    return p && (p->ct_tag == lua::CFFI_CTYPE_TAG);
+    auto *p = static_cast<ctype *>(lua::testcdata(L, idx));
+    return p && (p->flags & CDATA_CTYPE);
 }
 
 static inline bool iscval(lua_State *L, int idx) {
-    return luaL_testudata(L, idx, lua::CFFI_CDATA_MT);
+    return lua::testcdata(L, idx);
 }
 
 static inline bool isctype(cdata const &cd) {
-    return cd.gc_ref == lua::CFFI_CTYPE_TAG;
+    return cd.flags & CDATA_CTYPE;
 }
 
 static inline cdata &checkcdata(lua_State *L, int idx) {
-    auto ret = static_cast<cdata *>(
-        luaL_checkudata(L, idx, lua::CFFI_CDATA_MT)
-    );
-    if (isctype(*ret)) {
+    auto ret = static_cast<cdata *>(lua::testcdata(L, idx));
+    if (!ret || isctype(*ret)) {
         lua::type_error(L, idx, "cdata");
     }
     return *ret;
 }
 
 static inline cdata *testcval(lua_State *L, int idx) {
-    return static_cast<cdata *>(
-        luaL_testudata(L, idx, lua::CFFI_CDATA_MT)
-    );
+    return static_cast<cdata *>(lua::testcdata(L, idx));
 }
 
 static inline cdata *testcdata(lua_State *L, int idx) {
-    auto ret = static_cast<cdata *>(
-        luaL_testudata(L, idx, lua::CFFI_CDATA_MT)
-    );
+    auto ret = static_cast<cdata *>(lua::testcdata(L, idx));
     if (!ret || isctype(*ret)) {
         return nullptr;
     }
@@ -295,30 +497,59 @@ static inline cdata &tocdata(lua_State *L, int idx) {
 /* careful with this; use only if you're sure you have cdata at the index */
 static inline std::size_t cdata_value_size(lua_State *L, int idx) {
     auto &cd = tocdata(L, idx);
-    if (cd.decl.vla()) {
+    if (cd.flags & CDATA_VLASIZE) {
+        /* arena values only point to their memory */
+        std::size_t sz;
+        std::memcpy(
+            &sz, static_cast<unsigned char *>(cd.as_ptr()) + sizeof(void *),
+            sizeof(sz)
+        );
+        return sz;
+    } else if (cd.decl->vla()) {
         /* VLAs only exist on lua side, they are always allocated by us, so
          * we can be sure they are contained within the lua-allocated block
          *
          * the VLA memory consists of the following:
-         * - the cdata sequence with overallocation padding
+         * - the cdata header with possible overallocation padding
          * - the section where the pointer to data is stored
          * - and finally the VLA memory itself
          *
          * that means we take the length of the userdata and remove everything
          * that is not the raw array data, and that is our final length
          */
-        return (
-            lua_rawlen(L, idx) - cdata_pad_size() - sizeof(ffi::scalar_stor_t)
+        auto hsz = std::size_t(
+            static_cast<unsigned char *>(cd.as_ptr()) -
+            util::pun<unsigned char *>(&cd)
         );
+        return lua_rawlen(L, idx) - hsz - sizeof(ffi::scalar_stor_t);
     } else {
         /* otherwise the size is known, so fall back to that */
-        return cd.decl.alloc_size();
+        return cd.decl->alloc_size();
     }
 }
 
+/* sets or, given nil, removes the finalizer of the cdata at idx; both
+ * indexes must be absolute
+ */
+void set_finalizer(lua_State *L, int idx, int fidx);
 void destroy_cdata(lua_State *L, cdata &cd);
 void destroy_closure(lua_State *L, closure_data *cd);
 
+closure_pool &get_closure_pool(lua_State *L);
+
+/* frees the callback of the handle at idx, raising an error if that was
+ * done before through another handle; a freed callback goes back to the
+ * pool of its signature, or is destroyed if the pool is full, once no
+ * handle refers to it anymore
+ */
+void release_closure(lua_State *L, int idx);
+
+/* sets the bound of the closure pool, destroying closures beyond it, and
+ * returns the previous bound
+ */
+std::size_t resize_closure_pool(lua_State *L, std::size_t max);
+void destroy_closure_pool(lua_State *L, closure_pool &pool);
+
 int call_cif(cdata &fud, lua_State *L, std::size_t largs);
 
 enum conv_rule {
@@ -338,6 +569,20 @@ int to_lua(
     bool ffi_ret, bool lossy = false
 );
 
+/* converts `n` consecutive elements of type `tp` like to_lua with RULE_CONV;
+ * they are stored at indexes 1 to `n` of the table at `tidx`, or pushed on
+ * the stack if `tidx` is zero
+ */
+void to_lua_array(
+    lua_State *L, ast::c_type const &tp, void const *value, std::size_t n,
+    int tidx
+);
+
+/* the converter of a scalar type that behaves like to_lua with RULE_CONV,
+ * or null for anything that must go through to_lua
+ */
+elem_push elem_pusher(ast::c_type const &tp);
+
 /* a unified version of from_lua that combines together the complex aggregate
  * initialization logic and simple conversions from scalar types, resulting
  * in an all in one function that can take care of storing the C value of
@@ -345,26 +590,38 @@ int to_lua(
  */
 void from_lua(lua_State *L, ast::c_type const &decl, void *stor, int idx);
 
+/* stores the values at indexes 1 to `nelems` of the table at `tidx` in
+ * consecutive elements of type `tp`, starting at `stor`
+ */
+void from_lua_array(
+    lua_State *L, ast::c_type const &tp, void *stor, int tidx,
+    std::size_t nelems
+);
+
 void get_global(lua_State *L, lib::c_lib const *dl, const char *sname);
 void set_global(lua_State *L, lib::c_lib const *dl, char const *sname, int idx);
 
 void make_cdata(lua_State *L, ast::c_type const &decl, int rule, int idx);
 
+/* like make_cdata with RULE_CONV, but the value is carved from the arena;
+ * the resulting cdata refers to the arena memory and is never finalized:
+ * arrays stay arrays, records become references and scalars pointers
+ */
+void make_cdata_arena(
+    lua_State *L, arena &ar, ast::c_type const &decl, int idx
+);
+
+/* the metatable is referenced directly from the registry, the fields are
+ * not resolved ahead of time as the contents of the table may change
+ */
 static inline bool metatype_getfield(lua_State *L, int mt, char const *fname) {
-    luaL_getmetatable(L, lua::CFFI_CDATA_MT);
-    lua_getfield(L, -1, "__ffi_metatypes");
-    lua_rawgeti(L, -1, mt);
-    if (lua_istable(L, -1)) {
-        lua_getfield(L, -1, fname);
-        if (!lua_isnil(L, -1)) {
-            lua_insert(L, -4);
-            lua_pop(L, 3);
-            return true;
-        } else {
-            lua_pop(L, 1);
-        }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, mt);
+    lua_getfield(L, -1, fname);
+    if (!lua_isnil(L, -1)) {
+        lua_remove(L, -2);
+        return true;
     }
-    lua_pop(L, 3);
+    lua_pop(L, 2);
     return false;
 }
 
@@ -426,8 +683,8 @@ static inline bool test_arith(lua_State *L, int idx, T &out) {
         }
         return true;
     };
-    int tp = cd->decl.type();
-    if (cd->decl.is_ref()) {
+    int tp = cd->decl->type();
+    if (cd->decl->is_ref()) {
         if (gf(tp, *static_cast<void **>(cd->as_ptr()), out)) {
             return true;
         }
@@ -448,10 +705,10 @@ static inline T check_arith(lua_State *L, int idx) {
     return outv;
 }
 
+/* the cdata at the index, if any, is given by the caller */
 static inline ast::c_expr_type check_arith_expr(
-    lua_State *L, int idx, ast::c_value &iv
+    lua_State *L, int idx, cdata *cd, ast::c_value &iv
 ) {
-    auto *cd = testcdata(L, idx);
     if (!cd) {
         /* some logic for conversions of lua numbers into cexprs */
 #if LUA_VERSION_NUM >= 503
@@ -591,8 +848,8 @@ static inline ast::c_expr_type check_arith_expr(
         }
     };
     ast::c_expr_type ret;
-    int tp = cd->decl.type();
-    if (cd->decl.is_ref()) {
+    int tp = cd->decl->type();
+    if (cd->decl->is_ref()) {
         ret = gf(tp, *static_cast<void **>(cd->as_ptr()), iv);
     } else {
         ret = gf(tp, cd->as_ptr(), iv);
@@ -604,6 +861,12 @@ static inline ast::c_expr_type check_arith_expr(
     return ret;
 }
 
+static inline ast::c_expr_type check_arith_expr(
+    lua_State *L, int idx, ast::c_value &iv
+) {
+    return check_arith_expr(L, idx, testcdata(L, idx), iv);
+}
+
 static inline cdata &make_cdata_arith(
     lua_State *L, ast::c_expr_type et, ast::c_value const &cv
 ) {
@@ -622,7 +885,7 @@ static inline char const *lua_serialize(lua_State *L, int idx) {
     auto *cd = testcdata(L, idx);
     if (cd) {
         /* it's ok to mess up the lua stack, this is only used for errors */
-        cd->decl.serialize(L);
+        cd->decl->serialize(L);
         return lua_tostring(L, -1);
     }
     return lua_typename(L, lua_type(L, idx));
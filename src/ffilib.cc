@@ -9,6 +9,7 @@
 #include "lib.hh"
 #include "lua.hh"
 #include "ffi.hh"
+#include "image.hh"
 #include "util.hh"
 
 /* sets up the metatable for library, i.e. the individual namespaces
@@ -82,15 +83,14 @@ struct cdata_meta {
 
     static int metatype_getmt(lua_State *L, int idx, int &mflags) {
         auto &cd = ffi::tocdata(L, idx);
-        auto *decl = &cd.decl;
-        auto tp = decl->type();
+        auto tp = cd.decl->type();
         if (tp == ast::C_BUILTIN_RECORD) {
-            return cd.decl.record().metatype(mflags);
+            return cd.decl->record().metatype(mflags);
         } else if (tp == ast::C_BUILTIN_PTR) {
-            if (cd.decl.ptr_base().type() != ast::C_BUILTIN_RECORD) {
+            if (cd.decl->ptr_base().type() != ast::C_BUILTIN_RECORD) {
                 return LUA_REFNIL;
             }
-            return cd.decl.ptr_base().record().metatype(mflags);
+            return cd.decl->ptr_base().record().metatype(mflags);
         }
         return LUA_REFNIL;
     }
@@ -125,7 +125,7 @@ struct cdata_meta {
             }
 #endif
             lua_pushliteral(L, "ctype<");
-            cd.decl.serialize(L);
+            cd.decl->serialize(L);
             lua_pushliteral(L, ">");
             lua_concat(L, 3);
             return 1;
@@ -140,7 +140,7 @@ struct cdata_meta {
             lua_pop(L, 1);
         }
 #endif
-        auto const *tp = &cd.decl;
+        auto const *tp = cd.decl;
         void *val = cd.as_deref_ptr();
         /* 64-bit integers */
         /* XXX: special printing for lua builds with non-double numbers? */
@@ -164,7 +164,7 @@ struct cdata_meta {
             return 1;
         }
         lua_pushliteral(L, "cdata<");
-        cd.decl.serialize(L);
+        cd.decl->serialize(L);
         lua_pushfstring(L, ">: %p", cd.address_of());
         lua_concat(L, 3);
         return 1;
@@ -178,21 +178,23 @@ struct cdata_meta {
                 lua_insert(L, 1);
                 lua_call(L, nargs, 1);
             } else {
-                ffi::make_cdata(L, fd.decl, ffi::RULE_CONV, 2);
+                ffi::make_cdata(L, *fd.decl, ffi::RULE_CONV, 2);
             }
             return 1;
         }
-        if (!fd.decl.callable()) {
+        if (!fd.decl->callable()) {
             int nargs = lua_gettop(L);
             if (metatype_check<ffi::METATYPE_FLAG_CALL>(L, 1)) {
                 lua_insert(L, 1);
                 lua_call(L, nargs, LUA_MULTRET);
                 return lua_gettop(L);
             }
-            fd.decl.serialize(L);
+            fd.decl->serialize(L);
             luaL_error(L, "'%s' is not callable", lua_tostring(L, -1));
         }
-        if (fd.decl.closure() && !fd.as<ffi::fdata>().cd) {
+        if (fd.decl->closure() && (
+            !fd.as<ffi::fdata>().cd || fd.as<ffi::fdata>().cd->freed
+        )) {
             luaL_error(L, "bad callback");
         }
         return ffi::call_cif(fd, L, lua_gettop(L) - 1);
@@ -210,7 +212,7 @@ struct cdata_meta {
             }
         }
         void **valp = static_cast<void **>(cd.as_deref_ptr());
-        auto const *decl = &cd.decl;
+        auto const *decl = cd.decl;
         if (
             (decl->type() == ast::C_BUILTIN_PTR) &&
             (lua_type(L, 2) == LUA_TSTRING)
@@ -239,12 +241,20 @@ struct cdata_meta {
                 }
                 break;
             case ast::C_BUILTIN_RECORD: {
-                char const *fname = luaL_checkstring(L, 2);
+                std::size_t flen;
+                char const *fname = luaL_checklstring(L, 2, &flen);
                 ast::c_type const *outf;
-                auto foff = decl->record().field_offset(fname, outf);
+                auto &rec = decl->record();
+                auto foff = rec.field_offset(fname, flen, outf);
                 if (foff < 0) {
                     return false;
                 }
+                if (!outf->interned()) {
+                    /* only once per field, the index keeps the result */
+                    rec.field_offset(
+                        fname, flen, outf, &ast::decl_store::get_main(L)
+                    );
+                }
                 func(*outf, util::pun<unsigned char *>(valp) + foff);
                 return true;
             }
@@ -261,21 +271,19 @@ struct cdata_meta {
 
     static int cb_free(lua_State *L) {
         auto &cd = ffi::checkcdata(L, 1);
-        luaL_argcheck(L, cd.decl.closure(), 1, "not a callback");
-        auto &fd = cd.as<ffi::fdata>();
-        if (!fd.cd) {
+        luaL_argcheck(L, cd.decl->closure(), 1, "not a callback");
+        if (!cd.as<ffi::fdata>().cd) {
             luaL_error(L, "bad callback");
         }
-        ffi::destroy_closure(L, fd.cd);
-        /* prevent it from being set again, it's deleted anyway */
-        fd.cd = nullptr;
+        ffi::release_closure(L, 1);
         return 0;
     }
 
     static int cb_set(lua_State *L) {
         auto &cd = ffi::checkcdata(L, 1);
-        luaL_argcheck(L, cd.decl.closure(), 1, "not a callback");
-        if (!cd.as<ffi::fdata>().cd) {
+        luaL_argcheck(L, cd.decl->closure(), 1, "not a callback");
+        auto *clos = cd.as<ffi::fdata>().cd;
+        if (!clos || clos->freed) {
             luaL_error(L, "bad callback");
         }
         if (!lua_isfunction(L, 2)) {
@@ -289,7 +297,7 @@ struct cdata_meta {
 
     static int index(lua_State *L) {
         auto &cd = ffi::tocdata(L, 1);
-        if (cd.decl.closure()) {
+        if (cd.decl->closure()) {
             /* callbacks have some methods */
             char const *mname = lua_tostring(L, 2);
             /* if we had more methods, we'd do a table */
@@ -300,14 +308,14 @@ struct cdata_meta {
                 lua_pushcfunction(L, cb_set);
                 return 1;
             } else if (!mname) {
-                cd.decl.serialize(L);
+                cd.decl->serialize(L);
                 luaL_error(
                     L, "'%s' cannot be indexed with '%s'",
                     lua_tostring(L, -1),
                     lua_typename(L, lua_type(L, 2))
                 );
             } else {
-                cd.decl.serialize(L);
+                cd.decl->serialize(L);
                 luaL_error(
                     L, "'%s' has no member named '%s'",
                     lua_tostring(L, -1), mname
@@ -341,13 +349,13 @@ struct cdata_meta {
             luaL_error(L, "'ctype' is not indexable");
         }
         if (lua_type(L, 2) != LUA_TSTRING) {
-            cd.decl.serialize(L);
+            cd.decl->serialize(L);
             luaL_error(
                 L, "'%s' is not indexable with '%s'",
                 lua_tostring(L, -1), lua_typename(L, 2)
             );
         } else {
-            cd.decl.serialize(L);
+            cd.decl->serialize(L);
             luaL_error(
                 L, "'%s' has no member named '%s'",
                 lua_tostring(L, -1), lua_tostring(L, 2)
@@ -367,7 +375,7 @@ struct cdata_meta {
             lua_call(L, 3, 0);
             return 0;
         }
-        ffi::tocdata(L, 1).decl.serialize(L);
+        ffi::tocdata(L, 1).decl->serialize(L);
         luaL_error(
             L, "'%s' has no member named '%s'",
             lua_tostring(L, -1), lua_tostring(L, 2)
@@ -487,47 +495,221 @@ struct cdata_meta {
         }
     }
 
-    static ast::c_value arith_64bit_base(
-        lua_State *L, ast::c_expr_binop op, ast::c_expr_type &retp
+    /* the integer cases which are undefined in C give the same results
+     * as in LuaJIT instead
+     */
+    static long long div_64bit(long long a, long long b) {
+        if (!b || ((a == util::limit_min<long long>()) && (b == -1))) {
+            return util::limit_min<long long>();
+        }
+        return a / b;
+    }
+
+    static unsigned long long div_64bit(
+        unsigned long long a, unsigned long long b
     ) {
-        ast::c_expr bexp{ast::C_TYPE_WEAK}, lhs, rhs;
-        ast::c_expr_type lt = ffi::check_arith_expr(L, 1, lhs.val);
-        ast::c_expr_type rt = ffi::check_arith_expr(L, 2, rhs.val);
-        promote_sides(lt, lhs.val, rt, rhs.val);
-        lhs.type(lt);
-        rhs.type(rt);
-        bexp.type(ast::c_expr_type::BINARY);
-        bexp.bin.op = op;
-        bexp.bin.lhs = &lhs;
-        bexp.bin.rhs = &rhs;
-        ast::c_value ret;
-        if (!bexp.eval(L, ret, retp, true)) {
-            lua_error(L);
+        return b ? (a / b) : util::limit_max<unsigned long long>();
+    }
+
+    static long long mod_64bit(long long a, long long b) {
+        if (!b) {
+            return util::limit_min<long long>();
         }
-        return ret;
+        if ((a == util::limit_min<long long>()) && (b == -1)) {
+            return 0;
+        }
+        return a % b;
+    }
+
+    static unsigned long long mod_64bit(
+        unsigned long long a, unsigned long long b
+    ) {
+        return b ? (a % b) : util::limit_max<unsigned long long>();
+    }
+
+    /* the promoted operands are either both signed or both unsigned 64-bit
+     * integers, so every operator gets a kernel for the two cases instead
+     * of going through the constant expression evaluator; the operator is
+     * known at compile time, and overflow wraps around
+     */
+    template<ast::c_expr_binop op, typename T>
+    static T arith_64bit_kern(T a, T b) {
+        using U = unsigned long long;
+        switch (op) {
+            case ast::c_expr_binop::ADD: return T(U(a) + U(b));
+            case ast::c_expr_binop::SUB: return T(U(a) - U(b));
+            case ast::c_expr_binop::MUL: return T(U(a) * U(b));
+            case ast::c_expr_binop::DIV: return div_64bit(a, b);
+            case ast::c_expr_binop::MOD: return mod_64bit(a, b);
+            case ast::c_expr_binop::BAND: return T(a & b);
+            case ast::c_expr_binop::BOR: return T(a | b);
+            case ast::c_expr_binop::BXOR: return T(a ^ b);
+            default: break;
+        }
+        assert(false);
+        return T(0);
+    }
+
+    template<ast::c_expr_binop op, typename T>
+    static bool cmp_64bit_kern(T a, T b) {
+        switch (op) {
+            case ast::c_expr_binop::EQ: return a == b;
+            case ast::c_expr_binop::LT: return a < b;
+            case ast::c_expr_binop::LE: return a <= b;
+            default: break;
+        }
+        assert(false);
+        return false;
+    }
+
+    /* shifting by a negative count shifts in the other direction, like in
+     * Lua 5.3, and shifting out all the bits is not undefined either
+     */
+    template<ast::c_expr_binop op, typename T>
+    static T shift_64bit_kern(T a, long long n) {
+        using U = unsigned long long;
+        bool left = (op == ast::c_expr_binop::LSH);
+        if (n < 0) {
+            left = !left;
+            n = (n < -63) ? 64 : -n;
+        }
+        if (left) {
+            return (n > 63) ? T(0) : T(U(a) << n);
+        }
+        if (n > 63) {
+            /* only the sign bit remains */
+            return util::is_signed<T>::value ? T(a >> 63) : T(0);
+        }
+        return T(a >> n);
+    }
+
+    /* only the left side is promoted in shifts, the count is any integer
+     * and its sign says the direction; true if the left side is unsigned
+     */
+    template<ast::c_expr_binop op>
+    static bool shift_64bit_args(
+        lua_State *L, ffi::cdata *cd1, ffi::cdata *cd2,
+        ast::c_value &lv, long long &n
+    ) {
+        ast::c_expr_type lt = ffi::check_arith_expr(L, 1, cd1, lv);
+        promote_long(lt);
+        if (lt != ast::c_expr_type::ULLONG) {
+            promote_to_64bit<long long, ast::c_expr_type::LLONG>(lt, &lv);
+        }
+        n = shift_64bit_count<op>(L, cd2);
+        return (lt == ast::c_expr_type::ULLONG);
+    }
+
+    template<ast::c_expr_binop op>
+    static long long shift_64bit_count(lua_State *L, ffi::cdata *cd) {
+        ast::c_value v;
+        ast::c_expr_type t = ffi::check_arith_expr(L, 2, cd, v);
+        promote_long(t);
+        switch (t) {
+            case ast::c_expr_type::FLOAT:
+            case ast::c_expr_type::DOUBLE:
+            case ast::c_expr_type::LDOUBLE:
+                luaL_error(
+                    L, "invalid type(s) for (expr1 %s expr2)",
+                    (op == ast::c_expr_binop::LSH) ? "<<" : ">>"
+                );
+                return 0;
+            case ast::c_expr_type::ULLONG:
+                return (v.ull > 64) ? 64 : static_cast<long long>(v.ull);
+            default:
+                break;
+        }
+        promote_to_64bit<long long, ast::c_expr_type::LLONG>(t, &v);
+        return v.ll;
+    }
+
+    /* reads both operands and promotes them, true if they are unsigned */
+    static bool arith_64bit_args(
+        lua_State *L, ffi::cdata *cd1, ffi::cdata *cd2,
+        ast::c_value &lv, ast::c_value &rv
+    ) {
+        ast::c_expr_type lt = ffi::check_arith_expr(L, 1, cd1, lv);
+        ast::c_expr_type rt = ffi::check_arith_expr(L, 2, cd2, rv);
+        promote_sides(lt, lv, rt, rv);
+        return (lt == ast::c_expr_type::ULLONG);
+    }
+
+    /* the result takes the type of an operand when it is the same after
+     * promotion, as it is interned already, so accumulating into a 64-bit
+     * cdata does not look up the type every time; int64_t and uint64_t
+     * are long on LP64, so compare them as promote_long would
+     */
+    static ast::c_builtin promoted_builtin(ast::c_type const &tp) {
+        if (sizeof(long) == sizeof(long long)) {
+            switch (tp.type()) {
+                case ast::C_BUILTIN_LONG:
+                    return ast::C_BUILTIN_LLONG;
+                case ast::C_BUILTIN_ULONG:
+                    return ast::C_BUILTIN_ULLONG;
+                default:
+                    break;
+            }
+        }
+        return tp.type();
     }
 
-    static void arith_64bit_bin(lua_State *L, ast::c_expr_binop op) {
-        /* regular arithmetic */
-        ast::c_expr_type retp;
-        auto rv = arith_64bit_base(L, op, retp);
-        ffi::make_cdata_arith(L, retp, rv);
+    template<typename T>
+    static void push_64bit(
+        lua_State *L, ffi::cdata *cd1, ffi::cdata *cd2,
+        ast::c_expr_type et, T v
+    ) {
+        auto bt = ast::to_builtin_type(et);
+        ffi::cdata *cds[] = {cd1, cd2};
+        for (auto *cd: cds) {
+            if (
+                cd && (promoted_builtin(*cd->decl) == bt) &&
+                !cd->decl->is_ref() && !cd->decl->cv()
+            ) {
+                ffi::newcdata(L, *cd->decl, sizeof(T)).as<T>() = v;
+                return;
+            }
+        }
+        ast::c_value cv;
+        std::memcpy(&cv, &v, sizeof(T));
+        ffi::make_cdata_arith(L, et, cv);
     }
 
-    static void arith_64bit_cmp(lua_State *L, ast::c_expr_binop op) {
-        /* comparison */
-        ast::c_expr_type retp;
-        auto rv = arith_64bit_base(L, op, retp);
-        assert(retp == ast::c_expr_type::BOOL);
-        lua_pushboolean(L, rv.b);
+    template<ast::c_expr_binop op>
+    static void arith_64bit_bin(
+        lua_State *L, ffi::cdata *cd1, ffi::cdata *cd2
+    ) {
+        ast::c_value lv, rv;
+        if (arith_64bit_args(L, cd1, cd2, lv, rv)) {
+            push_64bit(
+                L, cd1, cd2, ast::c_expr_type::ULLONG,
+                arith_64bit_kern<op>(lv.ull, rv.ull)
+            );
+        } else {
+            push_64bit(
+                L, cd1, cd2, ast::c_expr_type::LLONG,
+                arith_64bit_kern<op>(lv.ll, rv.ll)
+            );
+        }
+    }
+
+    template<ast::c_expr_binop op>
+    static void arith_64bit_cmp(
+        lua_State *L, ffi::cdata *cd1, ffi::cdata *cd2
+    ) {
+        ast::c_value lv, rv;
+        if (arith_64bit_args(L, cd1, cd2, lv, rv)) {
+            lua_pushboolean(L, cmp_64bit_kern<op>(lv.ull, rv.ull));
+        } else {
+            lua_pushboolean(L, cmp_64bit_kern<op>(lv.ll, rv.ll));
+        }
     }
 
     static int add(lua_State *L) {
         auto *cd1 = ffi::testcdata(L, 1);
         auto *cd2 = ffi::testcdata(L, 2);
         /* pointer arithmetic */
-        if (cd1 && cd1->decl.ptr_like()) {
-            auto asize = cd1->decl.ptr_base().alloc_size();
+        if (cd1 && cd1->decl->ptr_like()) {
+            auto asize = cd1->decl->ptr_base().alloc_size();
             if (!asize) {
                 if (op_try_mt<ffi::METATYPE_FLAG_ADD>(L, cd1, cd2)) {
                     return 1;
@@ -545,12 +727,12 @@ struct cdata_meta {
              * in case of a null pointer (and we want predicable behavior)
              */
             auto p = cd1->as_deref<std::uintptr_t>();
-            auto tp = cd1->decl.as_type(ast::C_BUILTIN_PTR);
+            auto tp = cd1->decl->as_type(ast::C_BUILTIN_PTR);
             auto &ret = ffi::newcdata(L,  tp.unref(), sizeof(void *));
             ret.as<std::uintptr_t>() = p + d * asize;
             return 1;
-        } else if (cd2 && cd2->decl.ptr_like()) {
-            auto asize = cd2->decl.ptr_base().alloc_size();
+        } else if (cd2 && cd2->decl->ptr_like()) {
+            auto asize = cd2->decl->ptr_base().alloc_size();
             if (!asize) {
                 if (op_try_mt<ffi::METATYPE_FLAG_ADD>(L, cd1, cd2)) {
                     return 1;
@@ -565,7 +747,7 @@ struct cdata_meta {
                 ffi::check_arith<std::ptrdiff_t>(L, 1);
             }
             auto p = cd2->as_deref<std::uintptr_t>();
-            auto tp = cd2->decl.as_type(ast::C_BUILTIN_PTR);
+            auto tp = cd2->decl->as_type(ast::C_BUILTIN_PTR);
             auto &ret = ffi::newcdata(L, tp.unref(), sizeof(void *));
             ret.as<std::uintptr_t>() = d * asize + p;
             return 1;
@@ -573,7 +755,7 @@ struct cdata_meta {
         if (op_try_mt<ffi::METATYPE_FLAG_ADD>(L, cd1, cd2)) {
             return 1;
         }
-        arith_64bit_bin(L, ast::c_expr_binop::ADD);
+        arith_64bit_bin<ast::c_expr_binop::ADD>(L, cd1, cd2);
         return 1;
     }
 
@@ -581,21 +763,21 @@ struct cdata_meta {
         auto *cd1 = ffi::testcdata(L, 1);
         auto *cd2 = ffi::testcdata(L, 2);
         /* pointer difference */
-        if (cd1 && cd1->decl.ptr_like()) {
-            auto asize = cd1->decl.ptr_base().alloc_size();
+        if (cd1 && cd1->decl->ptr_like()) {
+            auto asize = cd1->decl->ptr_base().alloc_size();
             if (!asize) {
                 if (op_try_mt<ffi::METATYPE_FLAG_SUB>(L, cd1, cd2)) {
                     return 1;
                 }
                 luaL_error(L, "unknown C type size");
             }
-            if (cd2 && cd2->decl.ptr_like()) {
-                if (!cd1->decl.ptr_base().is_same(cd2->decl.ptr_base(), true)) {
+            if (cd2 && cd2->decl->ptr_like()) {
+                if (!cd1->decl->ptr_base().is_same(cd2->decl->ptr_base(), true)) {
                     if (op_try_mt<ffi::METATYPE_FLAG_SUB>(L, cd1, cd2)) {
                         return 1;
                     }
-                    cd2->decl.serialize(L);
-                    cd1->decl.serialize(L);
+                    cd2->decl->serialize(L);
+                    cd1->decl->serialize(L);
                     luaL_error(
                         L, "cannot convert '%s' to '%s'",
                         lua_tostring(L, -2), lua_tostring(L, -1)
@@ -617,14 +799,14 @@ struct cdata_meta {
                 ffi::check_arith<std::ptrdiff_t>(L, 2);
             }
             auto p = cd1->as_deref<std::uintptr_t>();
-            auto &ret = ffi::newcdata(L, cd1->decl, sizeof(void *));
+            auto &ret = ffi::newcdata(L, *cd1->decl, sizeof(void *));
             ret.as<std::uintptr_t>() = p + d;
             return 1;
         }
         if (op_try_mt<ffi::METATYPE_FLAG_SUB>(L, cd1, cd2)) {
             return 1;
         }
-        arith_64bit_bin(L, ast::c_expr_binop::SUB);
+        arith_64bit_bin<ast::c_expr_binop::SUB>(L, cd1, cd2);
         return 1;
     }
 
@@ -633,7 +815,7 @@ struct cdata_meta {
         auto *cd1 = ffi::testcdata(L, 1);
         auto *cd2 = ffi::testcdata(L, 2);
         if (!op_try_mt<mflag>(L, cd1, cd2)) {
-            arith_64bit_bin(L, bop);
+            arith_64bit_bin<bop>(L, cd1, cd2);
         }
         return 1;
     }
@@ -708,7 +890,7 @@ struct cdata_meta {
     }
 
     static void *cmp_addr(ffi::cdata *cd) {
-        if (cd->decl.ptr_like()) {
+        if (cd->decl->ptr_like()) {
             return cd->as_deref<void *>();
         }
         return cd->as_deref_ptr();
@@ -722,20 +904,17 @@ struct cdata_meta {
             lua_pushboolean(L, false);
             return 1;
         }
-        if (
-            (cd1->gc_ref == lua::CFFI_CTYPE_TAG) ||
-            (cd2->gc_ref == lua::CFFI_CTYPE_TAG)
-        ) {
-            if (cd1->gc_ref != cd2->gc_ref) {
+        if (ffi::isctype(*cd1) || ffi::isctype(*cd2)) {
+            if (ffi::isctype(*cd1) != ffi::isctype(*cd2)) {
                 /* ctype against cdata */
                 lua_pushboolean(L, false);
             } else {
-                lua_pushboolean(L, cd1->decl.is_same(cd2->decl));
+                lua_pushboolean(L, cd1->decl->is_same(*cd2->decl));
             }
             return 1;
         }
-        if (!cd1->decl.arith() || !cd2->decl.arith()) {
-            if (cd1->decl.ptr_like() && cd2->decl.ptr_like()) {
+        if (!cd1->decl->arith() || !cd2->decl->arith()) {
+            if (cd1->decl->ptr_like() && cd2->decl->ptr_like()) {
                 lua_pushboolean(
                     L, cd1->as_deref<void *>() == cd2->as_deref<void *>()
                 );
@@ -752,18 +931,19 @@ struct cdata_meta {
             return 1;
         }
         /* otherwise compare values */
-        arith_64bit_cmp(L, ast::c_expr_binop::EQ);
+        arith_64bit_cmp<ast::c_expr_binop::EQ>(L, cd1, cd2);
         return 1;
     }
 
-    template<ffi::metatype_flag mf1, ffi::metatype_flag mf2>
+    template<
+        ffi::metatype_flag mf1, ffi::metatype_flag mf2, ast::c_expr_binop op
+    >
     static bool cmp_base(
-        lua_State *L, ast::c_expr_binop op,
-        ffi::cdata const *cd1, ffi::cdata const *cd2
+        lua_State *L, ffi::cdata *cd1, ffi::cdata *cd2
     ) {
         if (!cd1 || !cd2) {
             auto *ccd = (cd1 ? cd1 : cd2);
-            if (!ccd->decl.arith() || !lua_isnumber(L, 2 - !cd1)) {
+            if (!ccd->decl->arith() || !lua_isnumber(L, 2 - !cd1)) {
                 if (op_try_mt<mf1>(L, cd1, cd2)) {
                     return true;
                 } else if ((mf2 != mf1) && op_try_mt<mf2>(L, cd2, cd1)) {
@@ -775,19 +955,19 @@ struct cdata_meta {
                     ffi::lua_serialize(L, 1), ffi::lua_serialize(L, 2)
                 );
             }
-            arith_64bit_cmp(L, op);
+            arith_64bit_cmp<op>(L, cd1, cd2);
             return true;
         }
-        if (cd1->decl.arith() && cd2->decl.arith()) {
+        if (cd1->decl->arith() && cd2->decl->arith()) {
             /* compare values if both are arithmetic types */
-            arith_64bit_cmp(L, op);
+            arith_64bit_cmp<op>(L, cd1, cd2);
             return true;
         }
         /* compare only compatible pointers */
         if ((
-            (cd1->decl.type() != ast::C_BUILTIN_PTR) ||
-            (cd2->decl.type() != ast::C_BUILTIN_PTR)
-        ) || (!cd1->decl.ptr_base().is_same(cd2->decl.ptr_base(), true))) {
+            (cd1->decl->type() != ast::C_BUILTIN_PTR) ||
+            (cd2->decl->type() != ast::C_BUILTIN_PTR)
+        ) || (!cd1->decl->ptr_base().is_same(cd2->decl->ptr_base(), true))) {
             if (op_try_mt<mf1>(L, cd1, cd2)) {
                 return true;
             } else if ((mf2 != mf1) && op_try_mt<mf2>(L, cd2, cd1)) {
@@ -811,9 +991,9 @@ struct cdata_meta {
     static int lt(lua_State *L) {
         auto *cd1 = ffi::testcdata(L, 1);
         auto *cd2 = ffi::testcdata(L, 2);
-        if (cmp_base<ffi::METATYPE_FLAG_LT, ffi::METATYPE_FLAG_LT>(
-            L, ast::c_expr_binop::LT, cd1, cd2
-        )) {
+        if (cmp_base<
+            ffi::METATYPE_FLAG_LT, ffi::METATYPE_FLAG_LT, ast::c_expr_binop::LT
+        >(L, cd1, cd2)) {
             return 1;
         }
         lua_pushboolean(L, cmp_addr(cd1) < cmp_addr(cd2));
@@ -824,9 +1004,9 @@ struct cdata_meta {
         auto *cd1 = ffi::testcdata(L, 1);
         auto *cd2 = ffi::testcdata(L, 2);
         /* tries both (a <= b) and not (b < a), like lua */
-        if (cmp_base<ffi::METATYPE_FLAG_LE, ffi::METATYPE_FLAG_LT>(
-            L, ast::c_expr_binop::LE, cd1, cd2
-        )) {
+        if (cmp_base<
+            ffi::METATYPE_FLAG_LE, ffi::METATYPE_FLAG_LT, ast::c_expr_binop::LE
+        >(L, cd1, cd2)) {
             return 1;
         }
         lua_pushboolean(L, cmp_addr(cd1) <= cmp_addr(cd2));
@@ -866,26 +1046,19 @@ struct cdata_meta {
         if (op_try_mt<mflag>(L, cd1, cd2)) {
             return 1;
         }
-        ast::c_expr_type retp;
-        ast::c_expr bexp{ast::C_TYPE_WEAK}, lhs, rhs;
-        ast::c_expr_type lt = ffi::check_arith_expr(L, 1, lhs.val);
-        ast::c_expr_type rt = ffi::check_arith_expr(L, 2, rhs.val);
-        /* we're only promoting the left side in shifts */
-        promote_long(lt);
-        if (lt != ast::c_expr_type::ULLONG) {
-            promote_to_64bit<long long, ast::c_expr_type::LLONG>(lt, &lhs.val);
-        }
-        lhs.type(lt);
-        rhs.type(rt);
-        bexp.type(ast::c_expr_type::BINARY);
-        bexp.bin.op = bop;
-        bexp.bin.lhs = &lhs;
-        bexp.bin.rhs = &rhs;
-        ast::c_value rv;
-        if (!bexp.eval(L, rv, retp, true)) {
-            lua_error(L);
+        ast::c_value lv;
+        long long n;
+        if (shift_64bit_args<bop>(L, cd1, cd2, lv, n)) {
+            push_64bit(
+                L, cd1, cd2, ast::c_expr_type::ULLONG,
+                shift_64bit_kern<bop>(lv.ull, n)
+            );
+        } else {
+            push_64bit(
+                L, cd1, cd2, ast::c_expr_type::LLONG,
+                shift_64bit_kern<bop>(lv.ll, n)
+            );
         }
-        ffi::make_cdata_arith(L, retp, rv);
         return 1;
     }
 
@@ -913,14 +1086,9 @@ struct cdata_meta {
         lua_pushliteral(L, "ffi");
         lua_setfield(L, -2, "__metatable");
 
-        /* this will store registered permanent struct/union metatypes
-         *
-         * it's used instead of regular lua registry because there is no
-         * way to reasonably garbage collect these references, and they die
-         * with the rest of the ffi anyway, so...
-         */
-        lua_newtable(L);
-        lua_setfield(L, -2, "__ffi_metatypes");
+        lua_pushlightuserdata(L, lua::cdata_key());
+        lua_pushboolean(L, 1);
+        lua_rawset(L, -3);
 
         lua_pushcfunction(L, tostring);
         lua_setfield(L, -2, "__tostring");
@@ -1033,7 +1201,22 @@ struct cdata_meta {
 #endif /* LUA_VERSION_NUM > 502 */
 #endif /* LUA_VERSION_NUM > 501 */
 
-        lua_pop(L, 1);
+        /* the same metamethods, but no finalizer; the function objects
+         * must be shared, as 5.1 compares them for binary metamethods
+         */
+        if (!luaL_newmetatable(L, lua::CFFI_CDATA_LIGHT_MT)) {
+            luaL_error(L, "unexpected error: registry reinitialized");
+        }
+        lua_pushnil(L);
+        while (lua_next(L, -3)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -4);
+        }
+        lua_pushnil(L);
+        lua_setfield(L, -2, "__gc");
+
+        lua_pop(L, 2);
     }
 };
 
@@ -1046,26 +1229,151 @@ struct ffi_module {
         return 0;
     }
 
+    static int cdef_image_f(lua_State *L) {
+        std::size_t slen;
+        char const *inp = luaL_checklstring(L, 1, &slen);
+        if (!image::load(L, inp, slen)) {
+            luaL_where(L, 1);
+            lua_insert(L, -2);
+            lua_concat(L, 2);
+            lua_error(L);
+        }
+        return 0;
+    }
+
+    static bool dump_image(lua_State *L, ast::decl_store const &ds, void *) {
+        util::strbuf out;
+        if (!image::dump(L, ds, out)) {
+            return false;
+        }
+        lua_pushlstring(L, out.data(), out.size());
+        return true;
+    }
+
+    static int dump_image_f(lua_State *L) {
+        if (lua_isnoneornil(L, 1)) {
+            if (!dump_image(L, ast::decl_store::get_main(L), nullptr)) {
+                lua_error(L);
+            }
+            return 1;
+        }
+        /* only dump the given declarations, without declaring them */
+        std::size_t slen;
+        char const *inp = luaL_checklstring(L, 1, &slen);
+        parser::parse_staged(
+            L, inp, inp + slen, (lua_gettop(L) > 1) ? 2 : -1,
+            dump_image, nullptr
+        );
+        return 1;
+    }
+
     /* either gets a ctype or makes a ctype from a string */
+    /* parsed ctypes are cached by their source string and parameters,
+     * so that hot paths like cffi.cast("uint8_t *", p) do not have to
+     * go through the parser every time; as type strings are often built
+     * on the fly, the cache is simply thrown away once it fills up
+     */
+    static constexpr lua_Integer CTYPE_CACHE_MAX = 256;
+
+    /* pushes the cache key and returns true if the type can be cached */
+    static bool ctype_cache_key(lua_State *L, int idx, int paridx) {
+        lua_pushvalue(L, idx);
+        if (paridx < 0) {
+            return true;
+        }
+        int top = lua_gettop(L) - 1;
+        for (int i = paridx; i <= top; ++i) {
+            /* types passed as parameters have no identity we could use */
+            switch (lua_type(L, i)) {
+                case LUA_TNUMBER: {
+                    /* converting numbers to strings may round them, so the
+                     * key uses the exact value, which only integers have
+                     */
+                    lua_Integer iv = lua_tointeger(L, i);
+#if LUA_VERSION_NUM >= 503
+                    bool exact = lua_isinteger(L, i);
+#else
+                    bool exact = (lua_Number(iv) == lua_tonumber(L, i));
+#endif
+                    if (!exact) {
+                        lua_settop(L, top);
+                        return false;
+                    }
+                    char buf[32];
+                    buf[0] = '\1';
+                    util::write_i(buf + 1, sizeof(buf) - 1, iv);
+                    lua_pushstring(L, buf);
+                    continue;
+                }
+                case LUA_TSTRING:
+                    lua_pushliteral(L, "\2");
+                    break;
+                default:
+                    lua_settop(L, top);
+                    return false;
+            }
+            lua_pushvalue(L, i);
+        }
+        lua_concat(L, lua_gettop(L) - top);
+        return true;
+    }
+
     static ast::c_type const &check_ct(
         lua_State *L, int idx, int paridx = -1
     ) {
         if (ffi::iscval(L, idx)) {
             auto &cd = ffi::tocdata(L, idx);
             if (ffi::isctype(cd)) {
-                return cd.decl;
+                return *cd.decl;
             }
-            auto &ct = ffi::newctype(L, cd.decl.copy());
+            auto &ct = ffi::newctype(L, *cd.decl);
             lua_replace(L, idx);
-            return ct.decl;
+            return *ct.decl;
         }
         std::size_t slen;
         char const *inp = luaL_checklstring(L, idx, &slen);
+        bool cache = ctype_cache_key(L, idx, paridx);
+        if (cache) {
+            /* stack: key */
+            lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CTYPE_CACHE);
+            lua_pushvalue(L, -2);
+            lua_rawget(L, -2);
+            if (!lua_isnil(L, -1)) {
+                auto &ct = ffi::tocdata(L, -1);
+                lua_replace(L, idx);
+                lua_pop(L, 2);
+                return *ct.decl;
+            }
+            lua_pop(L, 1);
+            /* stack: key, cache */
+        }
+        bool newdecl = true;
         auto &ct = ffi::newctype(
-            L, parser::parse_type(L, inp, inp + slen, paridx)
+            L, parser::parse_type(L, inp, inp + slen, paridx, &newdecl)
         );
+        if (cache && !newdecl) {
+            /* stack: key, cache, ctype */
+            lua_rawgeti(L, -2, 0);
+            auto nent = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            if (nent >= CTYPE_CACHE_MAX) {
+                lua_newtable(L);
+                lua_pushvalue(L, -1);
+                lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_CTYPE_CACHE);
+                lua_replace(L, -3);
+                nent = 0;
+            }
+            lua_pushvalue(L, -3);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -4);
+            lua_pushinteger(L, nent + 1);
+            lua_rawseti(L, -3, 0);
+        }
         lua_replace(L, idx);
-        return ct.decl;
+        if (cache) {
+            lua_pop(L, 2);
+        }
+        return *ct.decl;
     }
 
     static int new_f(lua_State *L) {
@@ -1143,13 +1451,13 @@ struct ffi_module {
 
 #undef FIELD_CHECK
 
-        /* get the metatypes table on the stack */
-        luaL_getmetatable(L, lua::CFFI_CDATA_MT);
-        lua_getfield(L, -1, "__ffi_metatypes");
-        /* the metatype */
+        /* the metatype is permanent, so the reference is never released;
+         * it's kept in the registry itself so that metamethod lookups
+         * need just one access to get to the metatable
+         */
         lua_pushvalue(L, 2);
         const_cast<ast::c_record &>(ct.record()).metatype(
-            luaL_ref(L, -2), mflags
+            luaL_ref(L, LUA_REGISTRYINDEX), mflags
         );
 
         lua_pushvalue(L, 1);
@@ -1179,7 +1487,7 @@ struct ffi_module {
     static int addressof_f(lua_State *L) {
         auto &cd = ffi::checkcdata(L, 1);
         ffi::newcdata(L, ast::c_type{
-            util::make_rc<ast::c_type>(util::move(cd.decl.unref())),
+            util::make_rc<ast::c_type>(util::move(cd.decl->unref())),
             0, ast::C_BUILTIN_PTR
         }, sizeof(void *)).as<void *>() = cd.address_of();
         return 1;
@@ -1187,21 +1495,106 @@ struct ffi_module {
 
     static int gc_f(lua_State *L) {
         auto &cd = ffi::checkcdata(L, 1);
-        if (lua_isnil(L, 2)) {
-            /* if nil and there is an existing finalizer, unset */
-            if (cd.gc_ref != LUA_REFNIL) {
-                luaL_unref(L, LUA_REGISTRYINDEX, cd.gc_ref);
-                cd.gc_ref = LUA_REFNIL;
-            }
-        } else {
-            /* new finalizer can be any type, it's pcall'd */
-            lua_pushvalue(L, 2);
-            cd.gc_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        /* if nil, only unset an existing finalizer; otherwise the new
+         * finalizer can be any type, it's pcall'd
+         */
+        if (!lua_isnil(L, 2) || (cd.flags & ffi::CDATA_FINALIZER)) {
+            ffi::set_finalizer(L, 1, 2);
         }
         lua_pushvalue(L, 1); /* return the cdata */
         return 1;
     }
 
+    static ffi::arena &check_arena(lua_State *L, int idx) {
+        return *static_cast<ffi::arena *>(
+            luaL_checkudata(L, idx, lua::CFFI_ARENA_MT)
+        );
+    }
+
+    static int arena_f(lua_State *L) {
+        auto isz = luaL_optinteger(L, 1, 4096);
+        luaL_argcheck(L, isz > 0, 1, "invalid size");
+        auto *ar = static_cast<ffi::arena *>(
+            lua_newuserdata(L, sizeof(ffi::arena))
+        );
+        new (ar) ffi::arena{std::size_t(isz)};
+        luaL_setmetatable(L, lua::CFFI_ARENA_MT);
+        return 1;
+    }
+
+    static int arena_new_f(lua_State *L) {
+        auto &ar = check_arena(L, 1);
+        ffi::make_cdata_arena(L, ar, check_ct(L, 2), 3);
+        /* the handle keeps the arena and thus its memory alive */
+#if LUA_VERSION_NUM > 502
+        lua_pushvalue(L, 1);
+        lua_setuservalue(L, -2);
+#else
+        /* older versions only take tables as user values, so the handles
+         * are mapped to their arena in a table with weak keys instead
+         */
+        lua_pushvalue(L, -1);
+        lua_pushvalue(L, 1);
+        lua_rawset(L, lua_upvalueindex(1));
+#endif
+        return 1;
+    }
+
+    static int arena_reset_f(lua_State *L) {
+        check_arena(L, 1).reset();
+        return 0;
+    }
+
+    static int arena_gc(lua_State *L) {
+        check_arena(L, 1).~arena();
+        return 0;
+    }
+
+    static int arena_tostring(lua_State *L) {
+        lua_pushfstring(L, "arena: %p", lua_touserdata(L, 1));
+        return 1;
+    }
+
+    static void setup_arena(lua_State *L) {
+        if (!luaL_newmetatable(L, lua::CFFI_ARENA_MT)) {
+            luaL_error(L, "unexpected error: registry reinitialized");
+        }
+
+        lua_pushliteral(L, "ffi");
+        lua_setfield(L, -2, "__metatable");
+
+        lua_pushcfunction(L, arena_gc);
+        lua_setfield(L, -2, "__gc");
+
+#if LUA_VERSION_NUM > 503
+        /* to-be-closed variables reset the arena when leaving the scope */
+        lua_pushcfunction(L, arena_reset_f);
+        lua_setfield(L, -2, "__close");
+#endif /* LUA_VERSION_NUM > 503 */
+
+        lua_pushcfunction(L, arena_tostring);
+        lua_setfield(L, -2, "__tostring");
+
+        static luaL_Reg const arena_def[] = {
+            {"new", arena_new_f},
+            {"reset", arena_reset_f},
+            {nullptr, nullptr}
+        };
+        luaL_newlib(L, arena_def);
+#if LUA_VERSION_NUM <= 502
+        lua_newtable(L);
+        lua_newtable(L);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushcclosure(L, arena_new_f, 1);
+        lua_setfield(L, -2, "new");
+#endif
+        lua_setfield(L, -2, "__index");
+
+        lua_pop(L, 1);
+    }
+
     static int sizeof_f(lua_State *L) {
         if (ffi::iscdata(L, 1)) {
             lua_pushinteger(L, ffi::cdata_value_size(L, 1));
@@ -1222,10 +1615,10 @@ struct ffi_module {
                 sz = std::size_t(isz);
             } else if (ffi::iscdata(L, 2)) {
                 auto &cd = ffi::tocdata(L, 2);
-                if (!cd.decl.integer()) {
+                if (!cd.decl->integer()) {
                     luaL_checkinteger(L, 2);
                 }
-                if (cd.decl.is_unsigned()) {
+                if (cd.decl->is_unsigned()) {
                     sz = ffi::check_arith<std::size_t>(L, 2);
                 } else {
                     auto isz = ffi::check_arith<long long>(L, 2);
@@ -1275,7 +1668,8 @@ struct ffi_module {
 
     static int offsetof_f(lua_State *L) {
         auto &ct = check_ct(L, 1);
-        char const *fname = luaL_checkstring(L, 2);
+        std::size_t flen;
+        char const *fname = luaL_checklstring(L, 2, &flen);
         if (ct.type() != ast::C_BUILTIN_RECORD) {
             return 0;
         }
@@ -1284,7 +1678,7 @@ struct ffi_module {
             return 0;
         }
         ast::c_type const *tp;
-        auto off = cs.field_offset(fname, tp);
+        auto off = cs.field_offset(fname, flen, tp);
         if (off >= 0) {
             lua_pushinteger(L, lua_Integer(off));
             return 1;
@@ -1301,12 +1695,12 @@ struct ffi_module {
         }
         if (ct.type() == ast::C_BUILTIN_RECORD) {
             /* if ct is a record, accept pointers to the struct */
-            if (cd->decl.type() == ast::C_BUILTIN_PTR) {
-                lua_pushboolean(L, ct.is_same(cd->decl.ptr_base(), true, true));
+            if (cd->decl->type() == ast::C_BUILTIN_PTR) {
+                lua_pushboolean(L, ct.is_same(cd->decl->ptr_base(), true, true));
                 return 1;
             }
         }
-        lua_pushboolean(L, ct.is_same(cd->decl, true, true));
+        lua_pushboolean(L, ct.is_same(*cd->decl, true, true));
         return 1;
     }
 
@@ -1319,6 +1713,111 @@ struct ffi_module {
         return 1;
     }
 
+#if LUA_VERSION_NUM >= 505
+    /* zero-copy strings over C memory, using lua 5.5 external strings
+     *
+     * every such string holds a registry reference to its owner; lua
+     * releases the buffer from inside the collector, where the API must
+     * not be touched, so the references are only queued at that point and
+     * dropped from the finalizer of a sentinel object, which is re-created
+     * for as long as there are strings around; the finalizers run at the
+     * end of the same cycle, so the owners go in the one after it
+     */
+    struct extstr_state;
+
+    struct extstr_node {
+        extstr_state *state;
+        extstr_node *next;
+        int ref;
+    };
+
+    struct extstr_state {
+        extstr_node *pending = nullptr;
+        /* live strings plus one for the lua state itself */
+        std::size_t nrefs = 1;
+        bool closed = false;
+        bool armed = false;
+    };
+
+    /* lua interns strings this short regardless (LUAI_MAXSHORTLEN) */
+    static constexpr std::size_t EXTSTR_MINLEN = 40;
+
+    static void extstr_unref(extstr_state *st) {
+        if (!--st->nrefs) {
+            delete st;
+        }
+    }
+
+    static void extstr_drain(lua_State *L, extstr_state &st) {
+        while (st.pending) {
+            auto *nd = st.pending;
+            st.pending = nd->next;
+            luaL_unref(L, LUA_REGISTRYINDEX, nd->ref);
+            delete nd;
+        }
+    }
+
+    /* a fresh sentinel, given the index of its metatable */
+    static void extstr_arm(lua_State *L, extstr_state &st, int mt) {
+        lua_newuserdatauv(L, 0, 0);
+        lua_pushvalue(L, mt);
+        lua_setmetatable(L, -2);
+        lua_pop(L, 1);
+        st.armed = true;
+    }
+
+    static void *extstr_release(void *ud, void *, std::size_t, std::size_t) {
+        auto *nd = static_cast<extstr_node *>(ud);
+        auto *st = nd->state;
+        if (st->closed) {
+            /* the registry is gone along with the references */
+            delete nd;
+        } else {
+            nd->next = st->pending;
+            st->pending = nd;
+        }
+        extstr_unref(st);
+        return nullptr;
+    }
+#endif
+
+    /* push a copy of the buffer, or with an owner at index `owner`, a
+     * string referencing the buffer directly where the lua version allows;
+     * `bound` is the number of bytes known to be readable at `s`, or zero
+     */
+    static void push_string(
+        lua_State *L, char const *s, std::size_t len, int owner,
+        std::size_t bound
+    ) {
+#if LUA_VERSION_NUM >= 505
+        /* external strings must be followed by a zero, which may only be
+         * looked at when it is within the memory
+         */
+        if (owner && (len > EXTSTR_MINLEN) && (len < bound) && !s[len]) {
+            lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_EXTSTR);
+            auto *st = *lua::touserdata<extstr_state *>(L, -1);
+            if (!st->armed) {
+                lua_getiuservalue(L, -1, 1);
+                extstr_arm(L, *st, lua_gettop(L));
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+            extstr_drain(L, *st);
+            lua_pushvalue(L, owner);
+            auto *nd = new extstr_node{
+                st, nullptr, luaL_ref(L, LUA_REGISTRYINDEX)
+            };
+            ++st->nrefs;
+            lua_pushexternalstring(L, s, len, extstr_release, nd);
+            return;
+        }
+#else
+        (void)owner;
+        (void)bound;
+#endif
+        lua_pushlstring(L, s, len);
+    }
+
     static int string_f(lua_State *L) {
         if (!ffi::iscval(L, 1)) {
             if (lua_type(L, 1) == LUA_TSTRING) {
@@ -1355,13 +1854,35 @@ struct ffi_module {
              * be serialized here (addresses will be taken automatically)
              */
             auto slen = ffi::check_arith<std::size_t>(L, 2);
-            switch (ud.decl.type()) {
+            int owner = lua_isnoneornil(L, 3) ? 0 : 3;
+            /* the caller may vouch for the byte after the data, which is
+             * how buffers only known by a pointer get to be owned
+             */
+            auto bound = util::limit_max<std::size_t>();
+            bool zterm = lua_toboolean(L, 4);
+            switch (ud.decl->type()) {
                 case ast::C_BUILTIN_PTR:
+                    /* nothing is known about what is behind a pointer */
+                    push_string(
+                        L, static_cast<char const *>(*valp), slen, owner,
+                        zterm ? bound : 0
+                    );
+                    return 1;
                 case ast::C_BUILTIN_ARRAY:
-                    lua_pushlstring(L, static_cast<char const *>(*valp), slen);
+                    if (!zterm) {
+                        bound = (ud.decl->unbounded() || ud.decl->is_ref())
+                            ? 0
+                            : ffi::cdata_value_size(L, 1);
+                    }
+                    push_string(
+                        L, static_cast<char const *>(*valp), slen, owner, bound
+                    );
                     return 1;
                 case ast::C_BUILTIN_RECORD:
-                    lua_pushlstring(L, util::pun<char const *>(valp), slen);
+                    push_string(
+                        L, util::pun<char const *>(valp), slen, owner,
+                        zterm ? bound : ud.decl->alloc_size()
+                    );
                     return 1;
                 default:
                     break;
@@ -1373,10 +1894,10 @@ struct ffi_module {
          * are allowed, and their base type can be any kind of byte
          * signedness is not checked
          */
-        if (!ud.decl.ptr_like()) {
+        if (!ud.decl->ptr_like()) {
             goto converr;
         }
-        switch (ud.decl.ptr_base().type()) {
+        switch (ud.decl->ptr_base().type()) {
             case ast::C_BUILTIN_VOID:
             case ast::C_BUILTIN_CHAR:
             case ast::C_BUILTIN_SCHAR:
@@ -1385,10 +1906,10 @@ struct ffi_module {
             default:
                 goto converr;
         }
-        if (ud.decl.static_array()) {
+        if (ud.decl->static_array()) {
             char const *strp = static_cast<char const *>(*valp);
             /* static arrays are special (no need for null termination) */
-            auto slen = ud.decl.alloc_size();
+            auto slen = ud.decl->alloc_size();
             /* but if an embedded zero is found, terminate at that */
             auto *p = static_cast<char const *>(std::memchr(strp, '\0', slen));
             if (p) {
@@ -1401,7 +1922,7 @@ struct ffi_module {
         }
         return 1;
 converr:
-        ud.decl.serialize(L);
+        ud.decl->serialize(L);
         lua_pushfstring(
             L, "cannot convert '%s' to 'string'", lua_tostring(L, -1)
         );
@@ -1418,13 +1939,13 @@ converr:
                     L, false, idx, "cannot convert 'ctype' to 'void *'"
                 );
             }
-            if (cd.decl.ptr_like()) {
+            if (cd.decl->ptr_like()) {
                 return cd.as_deref<void *>();
             }
-            if (cd.decl.is_ref()) {
+            if (cd.decl->is_ref()) {
                 return cd.address_of();
             }
-            cd.decl.serialize(L);
+            cd.decl->serialize(L);
             lua_pushfstring(
                 L, "cannot convert '%s' to 'void *'",
                 lua_tostring(L, -1)
@@ -1471,16 +1992,300 @@ argcheck:
         return 0;
     }
 
+    /* checks for a pointer or array cdata with complete elements; `maxn` is
+     * the number of elements the array holds, if known
+     */
+    static ast::c_type const &check_elems(
+        lua_State *L, int idx, char const *errfmt, void *&ptr,
+        std::size_t &maxn
+    ) {
+        auto &cd = ffi::checkcdata(L, idx);
+        auto &decl = *cd.decl;
+        if (
+            (decl.type() != ast::C_BUILTIN_PTR) &&
+            (decl.type() != ast::C_BUILTIN_ARRAY)
+        ) {
+            decl.serialize(L);
+            lua_pushfstring(L, errfmt, lua_tostring(L, -1));
+            luaL_argcheck(L, false, idx, lua_tostring(L, -1));
+        }
+        auto &pb = decl.ptr_base();
+        if (
+            (pb.type() == ast::C_BUILTIN_VOID) || !pb.alloc_size() ||
+            pb.flex()
+        ) {
+            pb.serialize(L);
+            lua_pushfstring(
+                L, "incomplete element type '%s'", lua_tostring(L, -1)
+            );
+            luaL_argcheck(L, false, idx, lua_tostring(L, -1));
+        }
+        maxn = ~std::size_t(0);
+        if (decl.type() == ast::C_BUILTIN_ARRAY) {
+            if (decl.vla() && !decl.is_ref()) {
+                maxn = ffi::cdata_value_size(L, idx) / pb.alloc_size();
+            } else if (!decl.unbounded()) {
+                maxn = decl.array_size();
+            }
+        }
+        ptr = cd.as_deref<void *>();
+        return pb;
+    }
+
+    static int fromtable_f(lua_State *L) {
+        void *dst;
+        std::size_t maxn;
+        auto &pb = check_elems(
+            L, 1, "cannot fill '%s' from a table", dst, maxn
+        );
+        luaL_checktype(L, 2, LUA_TTABLE);
+        std::size_t nelems;
+        if (lua_isnoneornil(L, 3)) {
+            nelems = lua_rawlen(L, 2);
+        } else {
+            nelems = ffi::check_arith<std::size_t>(L, 3);
+        }
+        luaL_argcheck(L, nelems <= maxn, 3, "too many elements");
+        ffi::from_lua_array(L, pb, dst, 2, nelems);
+        return 0;
+    }
+
+    static void const *check_range(
+        lua_State *L, char const *errfmt, ast::c_type const *&tp,
+        std::size_t &nelems
+    ) {
+        void *src;
+        std::size_t maxn;
+        tp = &check_elems(L, 1, errfmt, src, maxn);
+        nelems = ffi::check_arith<std::size_t>(L, 2);
+        std::size_t offset = 0;
+        if (!lua_isnoneornil(L, 3)) {
+            offset = ffi::check_arith<std::size_t>(L, 3);
+        }
+        luaL_argcheck(
+            L, (offset <= maxn) && (nelems <= (maxn - offset)), 2,
+            "range out of bounds"
+        );
+        return static_cast<unsigned char const *>(src) +
+            offset * tp->alloc_size();
+    }
+
+    static int totable_f(lua_State *L) {
+        ast::c_type const *tp;
+        std::size_t nelems;
+        auto *src = check_range(
+            L, "cannot convert '%s' to a table", tp, nelems
+        );
+        luaL_argcheck(
+            L, nelems <= std::size_t(util::limit_max<int>()), 2,
+            "too many elements"
+        );
+        lua_createtable(L, int(nelems), 0);
+        ffi::to_lua_array(L, *tp, src, nelems, lua_gettop(L));
+        return 1;
+    }
+
+    static int unpack_f(lua_State *L) {
+        ast::c_type const *tp;
+        std::size_t nelems;
+        auto *src = check_range(L, "cannot unpack '%s'", tp, nelems);
+        if (
+            (nelems >= std::size_t(util::limit_max<int>())) ||
+            !lua_checkstack(L, int(nelems))
+        ) {
+            luaL_error(L, "too many elements to unpack");
+        }
+        ffi::to_lua_array(L, *tp, src, nelems, 0);
+        return int(nelems);
+    }
+
+    /* array iterators pick the element conversion once, and then only step
+     * through memory; the source object is kept alive as an upvalue, and
+     * so is a ctype of the element type if that is not interned
+     */
+    struct iter_state {
+        unsigned char const *ptr;
+        std::size_t stride;
+        std::size_t idx;
+        std::size_t n;
+        ffi::elem_push push;
+        ast::c_type const *tp;
+    };
+
+    static int iter_next(lua_State *L) {
+        auto &st = *lua::touserdata<iter_state>(L, lua_upvalueindex(1));
+        if (st.idx >= st.n) {
+            return 0;
+        }
+        lua_pushinteger(L, lua_Integer(st.idx++));
+        if (st.push) {
+            st.push(L, *st.tp, st.ptr, false, false);
+        } else if (!ffi::to_lua(L, *st.tp, st.ptr, ffi::RULE_CONV, false)) {
+            luaL_error(L, "invalid C type");
+        }
+        st.ptr += st.stride;
+        return 2;
+    }
+
+    static int push_iter(
+        lua_State *L, int srcidx, ast::c_type const &tp, void const *src,
+        std::size_t n
+    ) {
+        auto *st = static_cast<iter_state *>(
+            lua_newuserdata(L, sizeof(iter_state))
+        );
+        st->ptr = static_cast<unsigned char const *>(src);
+        st->stride = tp.alloc_size();
+        st->idx = 0;
+        st->n = n;
+        st->push = ffi::elem_pusher(tp);
+        lua_pushvalue(L, srcidx);
+        if (tp.interned()) {
+            st->tp = &tp;
+            lua_pushcclosure(L, iter_next, 2);
+            return 1;
+        }
+        st->tp = ffi::newctype(L, tp).decl;
+        lua_pushcclosure(L, iter_next, 3);
+        return 1;
+    }
+
+    static int ipairs_f(lua_State *L) {
+        void *src;
+        std::size_t maxn;
+        auto &tp = check_elems(L, 1, "cannot iterate '%s'", src, maxn);
+        std::size_t nelems = maxn;
+        if (!lua_isnoneornil(L, 2)) {
+            nelems = ffi::check_arith<std::size_t>(L, 2);
+            luaL_argcheck(L, nelems <= maxn, 2, "range out of bounds");
+        } else {
+            luaL_argcheck(
+                L, maxn != ~std::size_t(0), 2, "unbounded element count"
+            );
+        }
+        return push_iter(L, 1, tp, src, nelems);
+    }
+
+    static int each_f(lua_State *L) {
+        auto &ct = check_ct(L, 1);
+        if (
+            (ct.type() == ast::C_BUILTIN_VOID) || !ct.alloc_size() ||
+            ct.flex()
+        ) {
+            ct.serialize(L);
+            lua_pushfstring(
+                L, "incomplete element type '%s'", lua_tostring(L, -1)
+            );
+            luaL_argcheck(L, false, 1, lua_tostring(L, -1));
+        }
+        auto *src = check_voidptr(L, 2);
+        auto nelems = ffi::check_arith<std::size_t>(L, 3);
+        return push_iter(L, 2, ct, src, nelems);
+    }
+
+    /* the target of in-place arithmetic is a mutable integer cdata */
+    static ffi::cdata &check_iarith(lua_State *L) {
+        auto &cd = ffi::checkcdata(L, 1);
+        auto &decl = *cd.decl;
+        switch (decl.type()) {
+            case ast::C_BUILTIN_CHAR:
+            case ast::C_BUILTIN_SCHAR:
+            case ast::C_BUILTIN_UCHAR:
+            case ast::C_BUILTIN_SHORT:
+            case ast::C_BUILTIN_USHORT:
+            case ast::C_BUILTIN_INT:
+            case ast::C_BUILTIN_UINT:
+            case ast::C_BUILTIN_LONG:
+            case ast::C_BUILTIN_ULONG:
+            case ast::C_BUILTIN_LLONG:
+            case ast::C_BUILTIN_ULLONG:
+                if (!(decl.cv() & ast::C_CV_CONST)) {
+                    return cd;
+                }
+                break;
+            default:
+                break;
+        }
+        decl.serialize(L);
+        lua_pushfstring(
+            L, "cannot modify '%s' in place", lua_tostring(L, -1)
+        );
+        luaL_argcheck(L, false, 1, lua_tostring(L, -1));
+        return cd;
+    }
+
+    /* the result is truncated to the target type like in C */
+    template<typename T>
+    static void iarith_store(ffi::cdata &cd, T v) {
+        void *dst = cd.as_deref_ptr();
+        switch (cd.decl->type()) {
+#define STORE_CASE(bt, U) \
+            case ast::C_BUILTIN_##bt: \
+                *static_cast<U *>(dst) = static_cast<U>(v); \
+                break;
+            STORE_CASE(CHAR, char)
+            STORE_CASE(SCHAR, signed char)
+            STORE_CASE(UCHAR, unsigned char)
+            STORE_CASE(SHORT, short)
+            STORE_CASE(USHORT, unsigned short)
+            STORE_CASE(INT, int)
+            STORE_CASE(UINT, unsigned int)
+            STORE_CASE(LONG, long)
+            STORE_CASE(ULONG, unsigned long)
+            STORE_CASE(LLONG, long long)
+            STORE_CASE(ULLONG, unsigned long long)
+#undef STORE_CASE
+            default:
+                assert(false);
+                break;
+        }
+    }
+
+    /* like the compound assignment operators in C, the operation is done
+     * the same way as the corresponding metamethod, but the result is
+     * written into the first operand instead of a new cdata
+     */
+    template<ast::c_expr_binop op>
+    static int iarith_f(lua_State *L) {
+        auto &cd = check_iarith(L);
+        ast::c_value lv, rv;
+        if (cdata_meta::arith_64bit_args(
+            L, &cd, ffi::testcdata(L, 2), lv, rv
+        )) {
+            iarith_store(cd, cdata_meta::arith_64bit_kern<op>(lv.ull, rv.ull));
+        } else {
+            iarith_store(cd, cdata_meta::arith_64bit_kern<op>(lv.ll, rv.ll));
+        }
+        lua_settop(L, 1);
+        return 1;
+    }
+
+    template<ast::c_expr_binop op>
+    static int ishift_f(lua_State *L) {
+        auto &cd = check_iarith(L);
+        ast::c_value lv;
+        long long n;
+        if (cdata_meta::shift_64bit_args<op>(
+            L, &cd, ffi::testcdata(L, 2), lv, n
+        )) {
+            iarith_store(cd, cdata_meta::shift_64bit_kern<op>(lv.ull, n));
+        } else {
+            iarith_store(cd, cdata_meta::shift_64bit_kern<op>(lv.ll, n));
+        }
+        lua_settop(L, 1);
+        return 1;
+    }
+
     static int tonumber_f(lua_State *L) {
         auto *cd = ffi::testcdata(L, 1);
         if (cd) {
-            if (cd->decl.arith()) {
+            if (cd->decl->arith()) {
                 ffi::to_lua(
-                    L, cd->decl, cd->as_deref_ptr(), ffi::RULE_CONV, false, true
+                    L, *cd->decl, cd->as_deref_ptr(), ffi::RULE_CONV, false, true
                 );
                 return 1;
             }
-            switch (cd->decl.type()) {
+            switch (cd->decl->type()) {
                 case ast::C_BUILTIN_PTR:
                 case ast::C_BUILTIN_RECORD:
                 case ast::C_BUILTIN_ARRAY:
@@ -1501,9 +2306,68 @@ argcheck:
         return lua_gettop(L);
     }
 
+    static int unbox64_f(lua_State *L) {
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_UNBOX64);
+        lua_pushboolean(L, lua_toboolean(L, -1));
+        if (!lua_isnone(L, 1)) {
+            lua_pushboolean(L, lua_toboolean(L, 1));
+            lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_UNBOX64);
+        }
+        return 1;
+    }
+
+    static int ptrintern_f(lua_State *L) {
+        auto &ds = ast::decl_store::get_main(L);
+        bool old = ds.ptr_intern();
+        lua_pushboolean(L, old);
+        if (lua_isnone(L, 1) || (lua_toboolean(L, 1) == old)) {
+            return 1;
+        }
+        if (old) {
+            lua_pushnil(L);
+        } else {
+            lua_newtable(L);
+        }
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_PTR_INTERN);
+        ds.set_ptr_intern(!old);
+        return 1;
+    }
+
+    static int key_f(lua_State *L) {
+        switch (lua_type(L, 1)) {
+            case LUA_TNIL:
+                lua_pushlightuserdata(L, nullptr);
+                return 1;
+            case LUA_TLIGHTUSERDATA:
+                lua_pushvalue(L, 1);
+                return 1;
+            default:
+                break;
+        }
+        auto *cd = ffi::testcdata(L, 1);
+        if (!cd || !cd->decl->ptr_like()) {
+            lua::type_error(L, 1, "pointer");
+        }
+        lua_pushlightuserdata(L, cd->as_deref<void *>());
+        return 1;
+    }
+
+    static int cbpool_f(lua_State *L) {
+        if (lua_isnone(L, 1)) {
+            lua_pushinteger(L, lua_Integer(ffi::get_closure_pool(L).max));
+            return 1;
+        }
+        auto max = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, max >= 0, 1, "invalid size");
+        lua_pushinteger(L, lua_Integer(
+            ffi::resize_closure_pool(L, std::size_t(max))
+        ));
+        return 1;
+    }
+
     static int toretval_f(lua_State *L) {
         auto &cd = ffi::checkcdata(L, 1);
-        ffi::to_lua(L, cd.decl, &cd.as<void *>(), ffi::RULE_RET, false);
+        ffi::to_lua(L, *cd.decl, &cd.as<void *>(), ffi::RULE_RET, false);
         return 1;
     }
 
@@ -1589,6 +2453,8 @@ argcheck:
         static luaL_Reg const lib_def[] = {
             /* core */
             {"cdef", cdef_f},
+            {"cdef_image", cdef_image_f},
+            {"dump_image", dump_image_f},
             {"load", load_f},
 
             /* data handling */
@@ -1598,6 +2464,7 @@ argcheck:
             {"typeof", typeof_f},
             {"addressof", addressof_f},
             {"gc", gc_f},
+            {"arena", arena_f},
 
             /* type info */
             {"sizeof", sizeof_f},
@@ -1610,6 +2477,25 @@ argcheck:
             {"string", string_f},
             {"copy", copy_f},
             {"fill", fill_f},
+            {"fromtable", fromtable_f},
+            {"totable", totable_f},
+            {"unpack", unpack_f},
+            {"ipairs", ipairs_f},
+            {"each", each_f},
+            {"iadd", iarith_f<ast::c_expr_binop::ADD>},
+            {"isub", iarith_f<ast::c_expr_binop::SUB>},
+            {"imul", iarith_f<ast::c_expr_binop::MUL>},
+            {"idiv", iarith_f<ast::c_expr_binop::DIV>},
+            {"imod", iarith_f<ast::c_expr_binop::MOD>},
+            {"iand", iarith_f<ast::c_expr_binop::BAND>},
+            {"ior", iarith_f<ast::c_expr_binop::BOR>},
+            {"ixor", iarith_f<ast::c_expr_binop::BXOR>},
+            {"ishl", ishift_f<ast::c_expr_binop::LSH>},
+            {"ishr", ishift_f<ast::c_expr_binop::RSH>},
+            {"unbox64", unbox64_f},
+            {"cbpool", cbpool_f},
+            {"ptrintern", ptrintern_f},
+            {"key", key_f},
             {"toretval", toretval_f},
             {"eval", eval_f},
             {"type", type_f},
@@ -1665,13 +2551,99 @@ argcheck:
         /* stack: empty */
     }
 
+    static void setup_closure_pool(lua_State *L) {
+        /* freed callbacks kept for reuse, released with the state */
+        auto *pool = static_cast<ffi::closure_pool *>(
+            lua_newuserdata(L, sizeof(ffi::closure_pool))
+        );
+        new (pool) ffi::closure_pool{};
+        lua_newtable(L);
+        lua_pushcfunction(L, [](lua_State *LL) -> int {
+            ffi::destroy_closure_pool(
+                LL, *lua::touserdata<ffi::closure_pool>(LL, 1)
+            );
+            return 0;
+        });
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_CLOSURE_POOL);
+    }
+
+#if LUA_VERSION_NUM >= 505
+    static void setup_extstr(lua_State *L) {
+        /* the state outlives the lua state if any strings are still
+         * around when it is closed, see extstr_release
+         */
+        auto **stp = static_cast<extstr_state **>(
+            lua_newuserdatauv(L, sizeof(extstr_state *), 1)
+        );
+        *stp = new extstr_state{};
+        int sidx = lua_gettop(L);
+        /* metatable of the sentinels, kept as the user value; the state
+         * is reached through the upvalue, as its finalizer may well run
+         * first when the lua state is closed, clearing the pointer
+         */
+        lua_newtable(L);
+        lua_pushvalue(L, sidx);
+        lua_pushvalue(L, -2);
+        lua_pushcclosure(L, [](lua_State *LL) -> int {
+            auto *st = *lua::touserdata<extstr_state *>(
+                LL, lua_upvalueindex(1)
+            );
+            if (!st) {
+                return 0;
+            }
+            st->armed = false;
+            extstr_drain(LL, *st);
+            if (st->nrefs > 1) {
+                extstr_arm(LL, *st, lua_upvalueindex(2));
+            }
+            return 0;
+        }, 2);
+        lua_setfield(L, -2, "__gc");
+        lua_setiuservalue(L, sidx, 1);
+        lua_newtable(L);
+        lua_pushcfunction(L, [](lua_State *LL) -> int {
+            auto **lstp = lua::touserdata<extstr_state *>(LL, 1);
+            auto *st = *lstp;
+            extstr_drain(LL, *st);
+            st->closed = true;
+            *lstp = nullptr;
+            extstr_unref(st);
+            return 0;
+        });
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_EXTSTR);
+    }
+#endif
+
     static void open(lua_State *L) {
         setup_dstor(L); /* declaration store */
         parser::init(L);
 
+        /* parsed type cache */
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_CTYPE_CACHE);
+
+        /* callbacks */
+        setup_closure_pool(L);
+
+#if LUA_VERSION_NUM >= 505
+        /* owners of zero-copy strings */
+        setup_extstr(L);
+#endif
+
+        /* finalizers set through cffi.gc or metatypes */
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_FINALIZERS);
+
         /* cdata handles */
         cdata_meta::setup(L);
 
+        /* scoped allocators */
+        setup_arena(L);
+
         setup(L); /* push table to stack */
 
         /* lib handles, needs the module table on the stack */
@@ -0,0 +1,1006 @@
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+#include "image.hh"
+
+namespace image {
+
+/* IMAGE LAYOUT:
+ *
+ * all values are stored in native byte order, images are not portable
+ * between platforms and the header is checked to make sure of that
+ *
+ * header:
+ *     u8  magic[5];       // IMAGE_MAGIC
+ *     u8  version;        // IMAGE_VERSION
+ *     u8  ptr_size;       // sizeof(void *)
+ *     u8  value_size;     // sizeof(ast::c_value)
+ *     u32 byte_order;     // IMAGE_BYTE_ORDER
+ *     u32 nobjects;
+ *
+ * object:
+ *     u8  kind;           // ast::c_object_type
+ *     u32 size;           // size of the following data
+ *     str name;
+ *     ... kind specific data:
+ *
+ *     RECORD:   u8 bits, then if complete: u32 nfields, (str name, type)...
+ *     ENUM:     u8 complete, then if complete: u32 nfields, (str, i32)...
+ *     TYPEDEF:  type
+ *     VARIABLE: str symbol (empty if same as name), type
+ *     CONSTANT: type, u8 value[value_size]
+ *
+ * type:
+ *     u8  builtin;        // ast::c_builtin
+ *     u8  cv;
+ *     u8  bits;
+ *     ... builtin specific data:
+ *
+ *     PTR:      type
+ *     ARRAY:    u64 size, type
+ *     FUNC:     u32 flags, type result, u32 nparams, (str name, type)...
+ *     RECORD:   u32 object index
+ *     ENUM:     u32 object index
+ *
+ * str:
+ *     u32 length, then the characters, without a terminating zero
+ *
+ * the ffi_type layouts of records are not stored; they are computed again
+ * when loading, which is cheap compared to parsing and does not require
+ * trusting the image with anything that could result in bad memory access;
+ * everything else is checked against what the parser could have produced,
+ * including that no size can wrap around
+ */
+
+static char const IMAGE_MAGIC[] = "\x7F" "cffi";
+static constexpr unsigned IMAGE_VERSION = 1;
+static constexpr std::uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+
+/* no C type nests anywhere near this deep */
+static constexpr int IMAGE_MAX_DEPTH = 256;
+
+enum type_bits {
+    TYPE_REF     = 1 << 0,
+    TYPE_CLOSURE = 1 << 1,
+    TYPE_NOSIZE  = 1 << 2,
+    TYPE_VLA     = 1 << 3,
+};
+
+enum record_bits {
+    RECORD_UNION    = 1 << 0,
+    RECORD_COMPLETE = 1 << 1,
+};
+
+/* writing */
+
+namespace {
+
+struct writer {
+    writer(lua_State *L, util::strbuf &out): p_L{L}, p_out{out} {}
+
+    void bytes(void const *data, std::size_t n) {
+        /* the string buffer only reserves what is asked for */
+        if (p_out.capacity() < (p_out.size() + n)) {
+            p_out.reserve((p_out.size() + n) * 2);
+        }
+        p_out.append(static_cast<char const *>(data), n);
+    }
+
+    void u8(unsigned v) {
+        auto c = static_cast<unsigned char>(v);
+        bytes(&c, 1);
+    }
+
+    void u32(std::uint32_t v) {
+        bytes(&v, sizeof(v));
+    }
+
+    void u64(std::uint64_t v) {
+        bytes(&v, sizeof(v));
+    }
+
+    void str(char const *s) {
+        auto len = std::strlen(s);
+        u32(std::uint32_t(len));
+        bytes(s, len);
+    }
+
+    /* records and enums are referred to by their index in the image */
+    void index(char const *name, std::uint32_t idx) {
+        p_idx.insert(name, idx);
+    }
+
+    bool ref(char const *name) {
+        auto *idx = p_idx.find(name);
+        if (!idx) {
+            lua_pushfstring(
+                p_L, "cannot dump '%s': declared outside of the image", name
+            );
+            return false;
+        }
+        u32(*idx);
+        return true;
+    }
+
+    bool type(ast::c_type const &tp) {
+        unsigned bits = 0;
+        auto bt = tp.type();
+        if (tp.is_ref()) {
+            bits |= TYPE_REF;
+        }
+        if ((bt == ast::C_BUILTIN_FUNC) && tp.closure()) {
+            bits |= TYPE_CLOSURE;
+        }
+        if (bt == ast::C_BUILTIN_ARRAY) {
+            if (tp.unbounded()) {
+                bits |= TYPE_NOSIZE;
+            }
+            if (tp.vla()) {
+                bits |= TYPE_VLA;
+            }
+        }
+        u8(bt);
+        u8(unsigned(tp.cv()));
+        u8(bits);
+        switch (bt) {
+            case ast::C_BUILTIN_PTR:
+                return type(tp.ptr_base());
+            case ast::C_BUILTIN_ARRAY:
+                u64(tp.array_size());
+                return type(tp.ptr_base());
+            case ast::C_BUILTIN_FUNC: {
+                auto &func = *tp.function();
+                u32(func.callconv() | (
+                    func.variadic() ? ast::C_FUNC_VARIADIC : 0
+                ));
+                if (!type(func.result())) {
+                    return false;
+                }
+                auto &params = func.params();
+                u32(std::uint32_t(params.size()));
+                for (std::size_t i = 0; i < params.size(); ++i) {
+                    str(params[i].name());
+                    if (!type(params[i].type())) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            case ast::C_BUILTIN_RECORD:
+                return ref(tp.record().name());
+            case ast::C_BUILTIN_ENUM:
+                return ref(tp.cenum().name());
+            default:
+                break;
+        }
+        return true;
+    }
+
+    bool object_data(ast::c_object const &obj) {
+        str(obj.name());
+        switch (obj.obj_type()) {
+            case ast::c_object_type::RECORD: {
+                auto &rec = obj.as<ast::c_record>();
+                unsigned bits = 0;
+                if (rec.is_union()) {
+                    bits |= RECORD_UNION;
+                }
+                if (!rec.opaque()) {
+                    bits |= RECORD_COMPLETE;
+                }
+                u8(bits);
+                if (rec.opaque()) {
+                    return true;
+                }
+                auto &flds = rec.raw_fields();
+                u32(std::uint32_t(flds.size()));
+                for (std::size_t i = 0; i < flds.size(); ++i) {
+                    str(flds[i].name.data());
+                    if (!type(flds[i].type)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            case ast::c_object_type::ENUM: {
+                auto &en = obj.as<ast::c_enum>();
+                u8(!en.opaque());
+                if (en.opaque()) {
+                    return true;
+                }
+                auto &flds = en.fields();
+                u32(std::uint32_t(flds.size()));
+                for (std::size_t i = 0; i < flds.size(); ++i) {
+                    str(flds[i].name.data());
+                    u32(std::uint32_t(flds[i].value));
+                }
+                return true;
+            }
+            case ast::c_object_type::TYPEDEF:
+                return type(obj.as<ast::c_typedef>().type());
+            case ast::c_object_type::VARIABLE: {
+                auto &var = obj.as<ast::c_variable>();
+                str(std::strcmp(var.sym(), var.name()) ? var.sym() : "");
+                return type(var.type());
+            }
+            case ast::c_object_type::CONSTANT: {
+                auto &cst = obj.as<ast::c_constant>();
+                if (!type(cst.type())) {
+                    return false;
+                }
+                bytes(&cst.value(), sizeof(ast::c_value));
+                return true;
+            }
+            default:
+                break;
+        }
+        lua_pushfstring(p_L, "cannot dump '%s': unknown object", obj.name());
+        return false;
+    }
+
+    bool object(ast::c_object const &obj) {
+        u8(unsigned(obj.obj_type()));
+        /* the size is filled in once the data is written */
+        auto szoff = p_out.size();
+        u32(0);
+        if (!object_data(obj)) {
+            return false;
+        }
+        auto sz = std::uint32_t(p_out.size() - szoff - sizeof(std::uint32_t));
+        std::memcpy(&p_out[szoff], &sz, sizeof(sz));
+        return true;
+    }
+
+private:
+    lua_State *p_L;
+    util::strbuf &p_out;
+    util::str_map<std::uint32_t> p_idx{};
+};
+
+} /* namespace */
+
+bool dump(lua_State *L, ast::decl_store const &ds, util::strbuf &out) {
+    writer w{L, out};
+
+    w.bytes(IMAGE_MAGIC, sizeof(IMAGE_MAGIC) - 1);
+    w.u8(IMAGE_VERSION);
+    w.u8(sizeof(void *));
+    w.u8(sizeof(ast::c_value));
+    w.u32(IMAGE_BYTE_ORDER);
+
+    std::uint32_t nobj = 0;
+    ds.for_each([&w, &nobj](ast::c_object const &obj) {
+        switch (obj.obj_type()) {
+            case ast::c_object_type::RECORD:
+            case ast::c_object_type::ENUM:
+                w.index(obj.name(), nobj);
+                break;
+            default:
+                break;
+        }
+        ++nobj;
+    });
+    w.u32(nobj);
+
+    bool ret = true;
+    ds.for_each([&w, &ret](ast::c_object const &obj) {
+        if (ret) {
+            ret = w.object(obj);
+        }
+    });
+    return ret;
+}
+
+/* reading */
+
+namespace {
+
+struct reader {
+    reader(char const *data, std::size_t len): p_data{data}, p_end{data + len} {}
+
+    /* once anything fails, everything after that fails too */
+    bool ok() const {
+        return p_ok;
+    }
+
+    bool fail() {
+        p_ok = false;
+        return false;
+    }
+
+    bool at_end() const {
+        return p_data == p_end;
+    }
+
+    bool bytes(void *out, std::size_t n) {
+        if (!p_ok || (std::size_t(p_end - p_data) < n)) {
+            std::memset(out, 0, n);
+            return fail();
+        }
+        std::memcpy(out, p_data, n);
+        p_data += n;
+        return true;
+    }
+
+    char const *skip(std::size_t n) {
+        if (!p_ok || (std::size_t(p_end - p_data) < n)) {
+            fail();
+            return nullptr;
+        }
+        auto *ret = p_data;
+        p_data += n;
+        return ret;
+    }
+
+    unsigned u8() {
+        unsigned char c;
+        bytes(&c, 1);
+        return c;
+    }
+
+    std::uint32_t u32() {
+        std::uint32_t v;
+        bytes(&v, sizeof(v));
+        return v;
+    }
+
+    std::uint64_t u64() {
+        std::uint64_t v;
+        bytes(&v, sizeof(v));
+        return v;
+    }
+
+    bool str(util::strbuf &out) {
+        auto len = u32();
+        auto *s = skip(len);
+        if (!s || std::memchr(s, '\0', len)) {
+            return fail();
+        }
+        out.set(s, len);
+        return true;
+    }
+
+private:
+    char const *p_data;
+    char const *p_end;
+    bool p_ok = true;
+};
+
+struct entry {
+    ast::c_object_type kind;
+    char const *data;
+    std::size_t size;
+    /* resolved records and enums, which may be existing declarations */
+    ast::c_object *obj;
+};
+
+struct record_body {
+    record_body(ast::c_record *r): rec{r} {}
+
+    ast::c_record *rec;
+    util::vector<ast::c_record::field> fields{};
+    /* no smaller than the size the layout will come out with */
+    std::size_t size = 0;
+    int state = 0;
+};
+
+/* an array of records from the image, which is checked once the size
+ * of the record is known
+ */
+struct record_array {
+    record_body *body;
+    std::size_t count;
+};
+
+struct enum_body {
+    enum_body(ast::c_enum *e): en{e} {}
+
+    ast::c_enum *en;
+    util::vector<ast::c_enum::field> fields{};
+};
+
+struct loader {
+    loader(lua_State *L):
+        p_L{L}, p_ds{ast::decl_store::get_main(L)}
+    {}
+
+    bool error(char const *msg) {
+        lua_pushstring(p_L, msg);
+        return false;
+    }
+
+    bool invalid() {
+        return error("invalid declaration image");
+    }
+
+    bool redefined(char const *name) {
+        lua_pushfstring(p_L, "'%s' redefined", name);
+        return false;
+    }
+
+    bool load(char const *data, std::size_t len) {
+        reader r{data, len};
+        char magic[sizeof(IMAGE_MAGIC) - 1];
+        r.bytes(magic, sizeof(magic));
+        if (!r.ok() || std::memcmp(magic, IMAGE_MAGIC, sizeof(magic))) {
+            return error("not a declaration image");
+        }
+        if (r.u8() != IMAGE_VERSION) {
+            return error("unsupported declaration image version");
+        }
+        if (
+            (r.u8() != sizeof(void *)) ||
+            (r.u8() != sizeof(ast::c_value)) ||
+            (r.u32() != IMAGE_BYTE_ORDER)
+        ) {
+            return error("declaration image is for a different platform");
+        }
+        auto nobj = r.u32();
+        /* every object takes at least 9 bytes, so don't trust huge counts */
+        if (!r.ok() || (nobj > (len / 9))) {
+            return invalid();
+        }
+        p_ents.reserve(nobj);
+        for (std::uint32_t i = 0; i < nobj; ++i) {
+            auto kind = ast::c_object_type(r.u8());
+            auto sz = r.u32();
+            auto *edata = r.skip(sz);
+            if (!edata) {
+                return invalid();
+            }
+            p_ents.push_back(entry{kind, edata, sz, nullptr});
+        }
+        if (!r.at_end()) {
+            return invalid();
+        }
+        /* records and enums first, as anything may refer to them */
+        for (std::size_t i = 0; i < p_ents.size(); ++i) {
+            switch (p_ents[i].kind) {
+                case ast::c_object_type::RECORD:
+                case ast::c_object_type::ENUM:
+                    if (!load_tagged(p_ents[i])) {
+                        return false;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        for (std::size_t i = 0; i < p_ents.size(); ++i) {
+            if (!load_object(p_ents[i])) {
+                return false;
+            }
+        }
+        /* everything was validated, now the fields can be set, which
+         * may also fill in previously opaque records in the main store
+         */
+        util::vector<record_body *> order;
+        if (!order_records(order) || !size_records(order)) {
+            return false;
+        }
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            order[i]->rec->set_fields(util::move(order[i]->fields));
+        }
+        for (std::size_t i = 0; i < p_enums.size(); ++i) {
+            p_enums[i].en->set_fields(util::move(p_enums[i].fields));
+        }
+        p_ds.commit();
+        return true;
+    }
+
+private:
+    /* the numeric part of anonymous names is specific to the store, so
+     * they get a new one; returns the length of the "struct " etc. part
+     */
+    static std::size_t anonymous(util::strbuf const &name) {
+        auto *sp = std::strchr(name.data(), ' ');
+        if (!sp || (sp[1] < '0') || (sp[1] > '9')) {
+            return 0;
+        }
+        return std::size_t(sp - name.data()) + 1;
+    }
+
+    bool load_tagged(entry &ent) {
+        reader r{ent.data, ent.size};
+        util::strbuf name;
+        r.str(name);
+        auto bits = r.u8();
+        if (!r.ok()) {
+            return invalid();
+        }
+        bool is_rec = (ent.kind == ast::c_object_type::RECORD);
+        bool complete = is_rec ? !!(bits & RECORD_COMPLETE) : !!bits;
+        auto anon = anonymous(name);
+        if (anon) {
+            char buf[32];
+            auto wn = p_ds.request_name(buf, sizeof(buf));
+            static_cast<void>(wn); /* silence NDEBUG warnings */
+            assert(wn < sizeof(buf));
+            util::strbuf aname{name.data(), anon};
+            aname.append(buf);
+            name = util::move(aname);
+        }
+        auto *old = p_ds.lookup(name.data());
+        if (old) {
+            if (old->obj_type() != ent.kind) {
+                return redefined(name.data());
+            }
+            if (complete) {
+                bool filled = is_rec
+                    ? (!old->as<ast::c_record>().opaque() ||
+                       p_rbodies.find(name.data()))
+                    : (!old->as<ast::c_enum>().opaque() ||
+                       p_ebodies.find(name.data()));
+                if (filled) {
+                    return redefined(name.data());
+                }
+            }
+            ent.obj = old;
+        } else {
+            if (is_rec) {
+                ent.obj = new ast::c_record{
+                    util::move(name), !!(bits & RECORD_UNION)
+                };
+            } else {
+                ent.obj = new ast::c_enum{util::move(name)};
+            }
+            p_ds.add(ent.obj);
+        }
+        if (!complete) {
+            return true;
+        }
+        if (is_rec) {
+            p_records.emplace_back(&ent.obj->as<ast::c_record>());
+            p_rbodies.insert(ent.obj->name(), p_records.size() - 1);
+        } else {
+            p_enums.emplace_back(&ent.obj->as<ast::c_enum>());
+            p_ebodies.insert(ent.obj->name(), p_enums.size() - 1);
+        }
+        return true;
+    }
+
+    bool load_type(reader &r, ast::c_type &out, int depth = 0) {
+        if (depth > IMAGE_MAX_DEPTH) {
+            return r.fail();
+        }
+        auto bt = r.u8();
+        auto cv = r.u8();
+        auto bits = r.u8();
+        if (
+            !r.ok() || (bt == ast::C_BUILTIN_INVALID) ||
+            (bt > ast::C_BUILTIN_LDOUBLE) ||
+            (cv & ~unsigned(ast::C_CV_CONST | ast::C_CV_VOLATILE)) ||
+            (bits & ~unsigned(TYPE_REF | TYPE_CLOSURE | TYPE_NOSIZE | TYPE_VLA))
+        ) {
+            return r.fail();
+        }
+        switch (bt) {
+            case ast::C_BUILTIN_PTR: {
+                ast::c_type base{};
+                if (!load_type(r, base, depth + 1)) {
+                    return false;
+                }
+                out = ast::c_type{
+                    util::make_rc<ast::c_type>(util::move(base)), cv,
+                    ast::C_BUILTIN_PTR
+                };
+                break;
+            }
+            case ast::C_BUILTIN_ARRAY: {
+                auto asize = r.u64();
+                ast::c_type base{};
+                if (!load_type(r, base, depth + 1)) {
+                    return false;
+                }
+                /* only the outermost bound may be unknown, in which case
+                 * there is no size, and functions cannot be elements
+                 */
+                bool nosize = !!(bits & TYPE_NOSIZE);
+                bool vla = !!(bits & TYPE_VLA);
+                if (
+                    ((nosize || vla) && asize) || (nosize && vla) ||
+                    (asize > util::limit_max<std::size_t>()) ||
+                    (!base.is_ref() && (
+                        (base.type() == ast::C_BUILTIN_FUNC) ||
+                        (base.builtin_array() && base.flex())
+                    ))
+                ) {
+                    return r.fail();
+                }
+                std::uint32_t flags = 0;
+                if (bits & TYPE_NOSIZE) {
+                    flags |= ast::C_TYPE_NOSIZE;
+                }
+                if (bits & TYPE_VLA) {
+                    flags |= ast::C_TYPE_VLA;
+                }
+                out = ast::c_type{
+                    util::make_rc<ast::c_type>(util::move(base)), cv,
+                    std::size_t(asize), flags
+                };
+                if (!check_array(out)) {
+                    return r.fail();
+                }
+                break;
+            }
+            case ast::C_BUILTIN_FUNC: {
+                auto fflags = r.u32();
+                if (
+                    (fflags & ~std::uint32_t(0xF | ast::C_FUNC_VARIADIC)) ||
+                    ((fflags & 0xF) > ast::C_FUNC_THISCALL)
+                ) {
+                    return r.fail();
+                }
+                ast::c_type result{};
+                if (!load_type(r, result, depth + 1)) {
+                    return false;
+                }
+                if (
+                    (result.type() != ast::C_BUILTIN_VOID) &&
+                    !by_value(result)
+                ) {
+                    return r.fail();
+                }
+                auto nparams = r.u32();
+                util::vector<ast::c_param> params;
+                for (std::uint32_t i = 0; i < nparams; ++i) {
+                    util::strbuf pname;
+                    ast::c_type ptype{};
+                    if (!r.str(pname) || !load_type(r, ptype, depth + 1)) {
+                        return false;
+                    }
+                    if (!by_value(ptype)) {
+                        return r.fail();
+                    }
+                    params.emplace_back(util::move(pname), util::move(ptype));
+                }
+                out = ast::c_type{
+                    util::make_rc<ast::c_function>(
+                        util::move(result), util::move(params), fflags
+                    ), cv, !!(bits & TYPE_CLOSURE)
+                };
+                break;
+            }
+            case ast::C_BUILTIN_RECORD:
+            case ast::C_BUILTIN_ENUM: {
+                auto idx = r.u32();
+                bool is_rec = (bt == ast::C_BUILTIN_RECORD);
+                if (!r.ok() || (idx >= p_ents.size()) || (
+                    p_ents[idx].kind != (is_rec
+                        ? ast::c_object_type::RECORD
+                        : ast::c_object_type::ENUM)
+                )) {
+                    return r.fail();
+                }
+                auto *obj = p_ents[idx].obj;
+                if (is_rec) {
+                    out = ast::c_type{&obj->as<ast::c_record>(), cv};
+                } else {
+                    out = ast::c_type{&obj->as<ast::c_enum>(), cv};
+                }
+                break;
+            }
+            default:
+                out = ast::c_type{ast::c_builtin(bt), cv};
+                break;
+        }
+        if (bits & TYPE_REF) {
+            out.add_ref();
+        }
+        return r.ok();
+    }
+
+    bool load_object(entry &ent) {
+        reader r{ent.data, ent.size};
+        util::strbuf name;
+        if (!r.str(name)) {
+            return invalid();
+        }
+        ast::c_object *obj = nullptr;
+        switch (ent.kind) {
+            case ast::c_object_type::RECORD: {
+                auto bits = r.u8();
+                if (!(bits & RECORD_COMPLETE)) {
+                    return true;
+                }
+                auto &b = p_records[*p_rbodies.find(ent.obj->name())];
+                auto nfields = r.u32();
+                for (std::uint32_t i = 0; i < nfields; ++i) {
+                    util::strbuf fname;
+                    ast::c_type ftype{};
+                    if (!r.str(fname) || !load_type(r, ftype)) {
+                        return invalid();
+                    }
+                    b.fields.emplace_back(util::move(fname), util::move(ftype));
+                }
+                return (r.ok() && r.at_end()) ? true : invalid();
+            }
+            case ast::c_object_type::ENUM: {
+                if (!r.u8()) {
+                    return true;
+                }
+                auto &b = p_enums[*p_ebodies.find(ent.obj->name())];
+                auto nfields = r.u32();
+                for (std::uint32_t i = 0; i < nfields; ++i) {
+                    util::strbuf fname;
+                    if (!r.str(fname)) {
+                        return invalid();
+                    }
+                    b.fields.emplace_back(util::move(fname), int(r.u32()));
+                }
+                return (r.ok() && r.at_end()) ? true : invalid();
+            }
+            case ast::c_object_type::TYPEDEF: {
+                ast::c_type tp{};
+                if (!load_type(r, tp)) {
+                    return invalid();
+                }
+                obj = new ast::c_typedef{util::move(name), util::move(tp)};
+                break;
+            }
+            case ast::c_object_type::VARIABLE: {
+                util::strbuf sym;
+                ast::c_type tp{};
+                if (!r.str(sym) || !load_type(r, tp) || is_void(tp)) {
+                    return invalid();
+                }
+                obj = new ast::c_variable{
+                    util::move(name), util::move(sym), util::move(tp)
+                };
+                break;
+            }
+            case ast::c_object_type::CONSTANT: {
+                ast::c_type tp{};
+                ast::c_value val;
+                if (
+                    !load_type(r, tp) || is_void(tp) ||
+                    !r.bytes(&val, sizeof(val))
+                ) {
+                    return invalid();
+                }
+                obj = new ast::c_constant{util::move(name), util::move(tp), val};
+                break;
+            }
+            default:
+                return invalid();
+        }
+        if (!r.at_end()) {
+            delete obj;
+            return invalid();
+        }
+        auto *old = p_ds.add(obj);
+        if (old) {
+            return redefined(old->name());
+        }
+        return true;
+    }
+
+    /* whether the record will be complete, i.e. usable by value */
+    record_body *body_of(ast::c_record const &rec) {
+        auto *idx = p_rbodies.find(rec.name());
+        return idx ? &p_records[*idx] : nullptr;
+    }
+
+    static bool is_void(ast::c_type const &tp) {
+        return !tp.is_ref() && (tp.type() == ast::C_BUILTIN_VOID);
+    }
+
+    /* what the parser allows to be passed to and returned from functions;
+     * typedefs and variables may still name opaque records, like in C
+     */
+    bool by_value(ast::c_type const &tp) {
+        if (tp.is_ref()) {
+            return true;
+        }
+        switch (tp.type()) {
+            case ast::C_BUILTIN_VOID:
+                return false;
+            case ast::C_BUILTIN_RECORD:
+                return !tp.record().opaque() || body_of(tp.record());
+            default:
+                break;
+        }
+        return true;
+    }
+
+    /* the size of a type, failing if it cannot be represented; records
+     * from the image have their upper bound from size_records
+     */
+    bool size_of(ast::c_type const &tp, std::size_t &out) {
+        if (tp.is_ref()) {
+            out = sizeof(void *);
+            return true;
+        }
+        switch (tp.type()) {
+            case ast::C_BUILTIN_ARRAY: {
+                std::size_t esz;
+                if (!size_of(tp.ptr_base(), esz)) {
+                    return false;
+                }
+                auto asize = tp.array_size();
+                if (esz && (asize > (util::limit_max<std::size_t>() / esz))) {
+                    return false;
+                }
+                out = asize * esz;
+                return true;
+            }
+            case ast::C_BUILTIN_RECORD: {
+                auto *body = body_of(tp.record());
+                out = body ? body->size : tp.record().alloc_size();
+                return true;
+            }
+            default:
+                break;
+        }
+        out = tp.alloc_size();
+        return true;
+    }
+
+    /* the size of an array must not wrap around, or it could be allocated
+     * smaller than it is indexed; when the elements are records from the
+     * image, the check is finished once those are sized
+     */
+    bool check_array(ast::c_type const &tp) {
+        std::size_t count = 1;
+        ast::c_type const *ep = &tp;
+        while (!ep->is_ref() && ep->builtin_array()) {
+            auto asize = ep->array_size();
+            if (asize && (count > (util::limit_max<std::size_t>() / asize))) {
+                return false;
+            }
+            count *= asize;
+            ep = &ep->ptr_base();
+        }
+        if (!ep->is_ref() && (ep->type() == ast::C_BUILTIN_RECORD)) {
+            auto *body = body_of(ep->record());
+            if (body) {
+                p_arrays.push_back(record_array{body, count});
+                return true;
+            }
+        }
+        std::size_t esz;
+        return size_of(*ep, esz) && (
+            !esz || (count <= (util::limit_max<std::size_t>() / esz))
+        );
+    }
+
+    /* validates the fields and orders the records so that everything a
+     * record contains by value is laid out before the record itself
+     */
+    bool order_records(util::vector<record_body *> &order) {
+        struct frame {
+            record_body *body;
+            std::size_t field;
+        };
+        util::vector<frame> stack;
+        for (std::size_t i = 0; i < p_records.size(); ++i) {
+            auto &rb = p_records[i];
+            if (rb.state) {
+                continue;
+            }
+            rb.state = 1;
+            stack.push_back(frame{&rb, 0});
+            while (!stack.empty()) {
+                auto &fr = stack.back();
+                auto &flds = fr.body->fields;
+                if (fr.field == flds.size()) {
+                    fr.body->state = 2;
+                    order.push_back(fr.body);
+                    stack.pop_back();
+                    continue;
+                }
+                auto &fld = flds[fr.field++];
+                ast::c_type const *tp = &fld.type;
+                bool flex = tp->flex();
+                while (!tp->is_ref() && tp->builtin_array()) {
+                    tp = &tp->ptr_base();
+                }
+                if (
+                    (flex && (fr.field != flds.size())) ||
+                    (fld.name.empty() && (
+                        (fld.type.type() != ast::C_BUILTIN_RECORD) ||
+                        fld.type.is_ref()
+                    ))
+                ) {
+                    return invalid();
+                }
+                if (tp->is_ref()) {
+                    continue;
+                }
+                if (
+                    (tp->type() == ast::C_BUILTIN_VOID) ||
+                    (tp->type() == ast::C_BUILTIN_FUNC)
+                ) {
+                    return invalid();
+                }
+                if (tp->type() != ast::C_BUILTIN_RECORD) {
+                    continue;
+                }
+                auto *dep = body_of(tp->record());
+                if (!dep) {
+                    if (tp->record().opaque()) {
+                        return invalid();
+                    }
+                    continue;
+                }
+                if (dep->state == 1) {
+                    /* records cannot contain themselves */
+                    return invalid();
+                }
+                if (!dep->state) {
+                    dep->state = 1;
+                    stack.push_back(frame{dep, 0});
+                }
+            }
+        }
+        return true;
+    }
+
+    /* sizes the records in layout order, each no smaller than what the
+     * layout will make of it, assuming the worst padding; a layout that
+     * would wrap around or have nothing in it is never attempted
+     */
+    bool size_records(util::vector<record_body *> const &order) {
+        auto smax = util::limit_max<std::size_t>();
+        std::size_t pad = alignof(util::max_aligned_t);
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            auto &flds = order[i]->fields;
+            bool uni = order[i]->rec->is_union();
+            /* a trailing flexible member of a struct takes no space */
+            std::size_t nflds = flds.size();
+            if (!uni && nflds && flds.back().type.flex()) {
+                --nflds;
+            }
+            /* libffi cannot lay out a struct with no elements */
+            std::size_t sz = 0;
+            bool empty = !uni || flds.empty();
+            for (std::size_t j = 0; j < nflds; ++j) {
+                std::size_t fsz;
+                if (!size_of(flds[j].type, fsz) || (fsz > (smax - pad))) {
+                    return invalid();
+                }
+                if (fsz) {
+                    empty = false;
+                }
+                fsz += pad;
+                if (uni) {
+                    sz = (fsz > sz) ? fsz : sz;
+                } else if (sz > (smax - fsz)) {
+                    return invalid();
+                } else {
+                    sz += fsz;
+                }
+            }
+            if (empty || (sz > (smax - pad))) {
+                return invalid();
+            }
+            order[i]->size = sz + pad;
+        }
+        for (std::size_t i = 0; i < p_arrays.size(); ++i) {
+            auto &ra = p_arrays[i];
+            if (ra.count > (smax / ra.body->size)) {
+                return invalid();
+            }
+        }
+        return true;
+    }
+
+    lua_State *p_L;
+    ast::decl_store p_ds;
+    util::vector<entry> p_ents{};
+    util::vector<record_body> p_records{};
+    util::vector<enum_body> p_enums{};
+    util::vector<record_array> p_arrays{};
+    util::str_map<std::size_t> p_rbodies{};
+    util::str_map<std::size_t> p_ebodies{};
+};
+
+} /* namespace */
+
+bool load(lua_State *L, char const *data, std::size_t len) {
+    loader ld{L};
+    return ld.load(data, len);
+}
+
+} /* namespace image */
@@ -0,0 +1,24 @@
+#ifndef IMAGE_HH
+#define IMAGE_HH
+
+#include "lua.hh"
+#include "ast.hh"
+#include "util.hh"
+
+namespace image {
+
+/* serializes all declarations of the store into a binary image, which can
+ * later be loaded without going through the parser; on failure, an error
+ * message is pushed on the stack
+ */
+bool dump(lua_State *L, ast::decl_store const &ds, util::strbuf &out);
+
+/* loads the declarations of an image into the main store, following the
+ * same redefinition rules as cdef; on failure, nothing is committed and
+ * an error message is pushed on the stack
+ */
+bool load(lua_State *L, char const *data, std::size_t len);
+
+} /* namespace image */
+
+#endif /* IMAGE_HH */
@@ -10,7 +10,7 @@ using func = void (*)();
 
 struct c_lib {
     handle h;
-    int cache;
+    int cache; /* symbol addresses and function cdata */
 };
 
 void load(c_lib *cl, char const *path, lua_State *L, bool global = false);
@@ -104,11 +104,18 @@ static inline void luaL_newlib52(lua_State *L, luaL_Reg const l[]) {
 
 namespace lua {
 
-static constexpr int CFFI_CTYPE_TAG = -128;
 static constexpr char const CFFI_CDATA_MT[] = "cffi_cdata_handle";
+static constexpr char const CFFI_CDATA_LIGHT_MT[] = "cffi_cdata_light_handle";
 static constexpr char const CFFI_LIB_MT[] = "cffi_lib_handle";
+static constexpr char const CFFI_ARENA_MT[] = "cffi_arena_handle";
 static constexpr char const CFFI_DECL_STOR[] = "cffi_decl_stor";
 static constexpr char const CFFI_PARSER_STATE[] = "cffi_parser_state";
+static constexpr char const CFFI_CTYPE_CACHE[] = "cffi_ctype_cache";
+static constexpr char const CFFI_FINALIZERS[] = "cffi_finalizers";
+static constexpr char const CFFI_CLOSURE_POOL[] = "cffi_closure_pool";
+static constexpr char const CFFI_UNBOX64[] = "cffi_unbox64";
+static constexpr char const CFFI_PTR_INTERN[] = "cffi_ptr_intern";
+static constexpr char const CFFI_EXTSTR[] = "cffi_extstr";
 
 template<typename T>
 static T *touserdata(lua_State *L, int index) {
@@ -127,6 +134,36 @@ static inline void mark_cdata(lua_State *L) {
     luaL_setmetatable(L, CFFI_CDATA_MT);
 }
 
+/* cdata which need no finalization use a copy of the metatable without
+ * __gc, sharing all the metamethods with the regular one
+ */
+static inline void mark_cdata_light(lua_State *L) {
+    luaL_setmetatable(L, CFFI_CDATA_LIGHT_MT);
+}
+
+/* both cdata metatables have this key set, so cdata are told apart from
+ * other userdata with a single lookup, whichever of the two they use;
+ * not static, so that all translation units share the address
+ */
+inline void *cdata_key() {
+    static char key;
+    return &key;
+}
+
+static inline void *testcdata(lua_State *L, int idx) {
+    void *p = lua_touserdata(L, idx);
+    if (!p || !lua_getmetatable(L, idx)) {
+        return nullptr;
+    }
+    lua_pushlightuserdata(L, cdata_key());
+    lua_rawget(L, -2);
+    if (!lua_toboolean(L, -1)) {
+        p = nullptr;
+    }
+    lua_pop(L, 2);
+    return p;
+}
+
 static inline void mark_lib(lua_State *L) {
     luaL_setmetatable(L, CFFI_LIB_MT);
 }
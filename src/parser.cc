@@ -290,6 +290,15 @@ struct lex_state {
         p_dstore.commit();
     }
 
+    /* whether this parse has created any new declarations */
+    bool staged() const {
+        return !p_dstore.empty();
+    }
+
+    ast::decl_store const &staged_store() const {
+        return p_dstore;
+    }
+
     ast::c_object const *lookup(char const *name) const {
         return p_dstore.lookup(name);
     }
@@ -362,11 +371,12 @@ struct lex_state {
         if (!ensure_pidx()) {
             return false;
         }
-        if (!luaL_testudata(p_L, p_pidx, lua::CFFI_CDATA_MT)) {
+        if (!lua::testcdata(p_L, p_pidx)) {
             p_P->ls_buf.set("type expected");
             return syntax_error();
         }
-        res = lua::touserdata<ast::c_type>(p_L, p_pidx)->copy();
+        /* both cdata and ctypes begin with the interned type */
+        res = (*lua::touserdata<ast::c_type const *>(p_L, p_pidx))->copy();
         /* consume $ */
         if (!get()) {
             return false;
@@ -2685,7 +2695,10 @@ static void parse_err(lua_State *L) {
     lua_error(L);
 }
 
-void parse(lua_State *L, char const *input, char const *iend, int paridx) {
+static void do_parse(
+    lua_State *L, char const *input, char const *iend, int paridx,
+    staged_cb cb, void *data
+) {
     if (!iend) {
         iend = input + std::strlen(input);
     }
@@ -2705,15 +2718,33 @@ void parse(lua_State *L, char const *input, char const *iend, int paridx) {
             }
             goto lerr;
         }
-        ls.commit();
-        return;
+        if (!cb) {
+            ls.commit();
+            return;
+        }
+        if (cb(L, ls.staged_store(), data)) {
+            /* the staged declarations are dropped with the lex state */
+            return;
+        }
     }
 lerr:
     parse_err(L);
 }
 
+void parse(lua_State *L, char const *input, char const *iend, int paridx) {
+    do_parse(L, input, iend, paridx, nullptr, nullptr);
+}
+
+void parse_staged(
+    lua_State *L, char const *input, char const *iend, int paridx,
+    staged_cb cb, void *data
+) {
+    do_parse(L, input, iend, paridx, cb, data);
+}
+
 ast::c_type parse_type(
-    lua_State *L, char const *input, char const *iend, int paridx
+    lua_State *L, char const *input, char const *iend, int paridx,
+    bool *newdecl
 ) {
     if (!iend) {
         iend = input + std::strlen(input);
@@ -2733,6 +2764,9 @@ ast::c_type parse_type(
             }
             goto lerr;
         }
+        if (newdecl) {
+            *newdecl = ls.staged();
+        }
         ls.commit();
         return tp;
     }
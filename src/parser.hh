@@ -12,8 +12,26 @@ void parse(
     lua_State *L, char const *input, char const *iend = nullptr, int paridx = -1
 );
 
+/* like parse, but the staged declarations are handed to the callback
+ * instead of being committed, and dropped afterwards; if the callback
+ * fails, it must push an error message, which is then raised
+ */
+using staged_cb = bool (*)(
+    lua_State *L, ast::decl_store const &ds, void *data
+);
+
+void parse_staged(
+    lua_State *L, char const *input, char const *iend, int paridx,
+    staged_cb cb, void *data
+);
+
+/* if newdecl is given, it is set to whether the type has introduced any
+ * new declarations (e.g. an anonymous struct); if it has not, parsing the
+ * same input with the same parameters will always yield the same type
+ */
 ast::c_type parse_type(
-    lua_State *L, char const *input, char const *iend = nullptr, int paridx = -1
+    lua_State *L, char const *input, char const *iend = nullptr,
+    int paridx = -1, bool *newdecl = nullptr
 );
 
 ast::c_expr_type parse_number(
@@ -394,6 +394,11 @@ struct rc_obj {
         incr();
     }
 
+    /* another reference to an object of a rc_obj or from make_raw */
+    explicit rc_obj(T *p): p_ptr{p} {
+        incr();
+    }
+
     ~rc_obj() {
         decr();
     }
@@ -435,14 +440,44 @@ struct rc_obj {
         util::swap(p_ptr, op.p_ptr);
     }
 
+    /* objects held through plain pointers are managed by hand; they are
+     * created with no references, and freed once the last one is released
+     */
+    template<typename ...A>
+    static T *make_raw(A &&...cargs) {
+        auto *np = new unsigned char[sizeof(T) + get_rc_size()];
+        *pun<std::size_t *>(np) = 0;
+        auto *ret = pun<T *>(np + get_rc_size());
+        new (ret) T(util::forward<A>(cargs)...);
+        return ret;
+    }
+
+    static void acquire(T const *p) {
+        ++*counter_of(p);
+    }
+
+    static void release(T const *p) {
+        auto *ptr = counter_of(p);
+        if (!--*ptr) {
+            p->~T();
+            delete[] pun<unsigned char *>(ptr);
+        }
+    }
+
 private:
     static constexpr std::size_t get_rc_size() {
         return (alignof(T) > sizeof(std::size_t))
             ? alignof(T) : sizeof(std::size_t);
     }
 
+    static std::size_t *counter_of(T const *p) {
+        return pun<std::size_t *>(
+            pun<unsigned char *>(const_cast<T *>(p)) - get_rc_size()
+        );
+    }
+
     std::size_t *counter() const {
-        return pun<std::size_t *>(pun<unsigned char *>(p_ptr) - get_rc_size());
+        return counter_of(p_ptr);
     }
 
     void incr() {
@@ -496,12 +531,12 @@ struct vector {
     }
 
     void push_back(T const &v) {
-        reserve(p_cap + 1);
+        grow();
         new (&p_buf[p_size++]) T(v);
     }
 
     void push_back(T &&v) {
-        reserve(p_cap + 1);
+        grow();
         new (&p_buf[p_size++]) T(util::move(v));
     }
 
@@ -512,7 +547,7 @@ struct vector {
 
     template<typename ...A>
     T &emplace_back(A &&...args) {
-        reserve(p_cap + 1);
+        grow();
         new (&p_buf[p_size]) T(util::forward<A>(args)...);
         return p_buf[p_size++];
     }
@@ -612,6 +647,13 @@ private:
         delete[] pun<unsigned char *>(p_buf);
     }
 
+    /* make room for one more element, growing geometrically */
+    void grow() {
+        if (p_size == p_cap) {
+            reserve(p_cap ? (p_cap * 2) : MIN_SIZE);
+        }
+    }
+
     T *p_buf = nullptr;
     std::size_t p_size = 0, p_cap = 0;
 };
@@ -784,13 +826,18 @@ private:
     util::vector<char> p_buf{};
 };
 
-/* hashtable */
+/* hashtable; the number of buckets is doubled whenever there are more
+ * elements than buckets, the hashes are kept so they're computed only once
+ *
+ * the bucket array is not allocated until something is inserted, so that
+ * maps that stay empty (e.g. staging decl stores) cost nothing
+ */
 
 template<typename K, typename V, typename HF, typename CF>
 struct map {
 private:
     static constexpr std::size_t CHUNK_SIZE = 64;
-    static constexpr std::size_t DEFAULT_SIZE = 1024;
+    static constexpr std::size_t DEFAULT_SIZE = 16;
 
     struct entry {
         K key;
@@ -799,14 +846,12 @@ private:
 
     struct bucket {
         entry value;
+        std::size_t hash;
         bucket *next;
     };
 
 public:
-    map(std::size_t sz = DEFAULT_SIZE): p_size{sz} {
-        p_buckets = new bucket *[sz];
-        std::memset(p_buckets, 0, sz * sizeof(bucket *));
-    }
+    map(std::size_t sz = DEFAULT_SIZE): p_size{sz ? sz : 1} {}
 
     ~map() {
         delete[] p_buckets;
@@ -828,6 +873,9 @@ public:
     }
 
     V *find(K const &key) const {
+        if (!p_nelems) {
+            return nullptr;
+        }
         std::size_t h;
         bucket *b = find_bucket(key, h);
         if (!b) {
@@ -853,7 +901,8 @@ public:
         }
         p_nelems = 0;
         p_unused = nullptr;
-        std::memset(p_buckets, 0, p_size * sizeof(bucket *));
+        delete[] p_buckets;
+        p_buckets = nullptr;
         drop_chunks();
     }
 
@@ -867,6 +916,9 @@ public:
 
     template<typename F>
     void for_each(F &&func) const {
+        if (!p_buckets) {
+            return;
+        }
         for (std::size_t i = 0; i < p_size; ++i) {
             for (bucket *b = p_buckets[i]; b; b = b->next) {
                 func(b->value.key, b->value.data);
@@ -876,6 +928,12 @@ public:
 
 private:
     bucket *add(std::size_t hash) {
+        if (!p_buckets) {
+            p_buckets = new bucket *[p_size];
+            std::memset(p_buckets, 0, p_size * sizeof(bucket *));
+        } else if (p_nelems >= p_size) {
+            rehash(p_size * 2);
+        }
         if (!p_unused) {
             chunk *nb = new chunk;
             nb->next = p_chunks;
@@ -888,16 +946,36 @@ private:
         }
         bucket *b = p_unused;
         p_unused = p_unused->next;
-        b->next = p_buckets[hash];
-        p_buckets[hash] = b;
+        b->hash = hash;
+        b->next = p_buckets[hash % p_size];
+        p_buckets[hash % p_size] = b;
         ++p_nelems;
         return b;
     }
 
+    /* the buckets stay where they are, only the chains are relinked */
+    void rehash(std::size_t nsz) {
+        bucket **nbuckets = new bucket *[nsz];
+        std::memset(nbuckets, 0, nsz * sizeof(bucket *));
+        for (std::size_t i = 0; i < p_size; ++i) {
+            for (bucket *nb, *b = p_buckets[i]; b; b = nb) {
+                nb = b->next;
+                b->next = nbuckets[b->hash % nsz];
+                nbuckets[b->hash % nsz] = b;
+            }
+        }
+        delete[] p_buckets;
+        p_buckets = nbuckets;
+        p_size = nsz;
+    }
+
     bucket *find_bucket(K const &key, std::size_t &h) const {
-        h = HF{}(key) % p_size;
-        for (bucket *b = p_buckets[h]; b; b = b->next) {
-            if (CF{}(key, b->value.key)) {
+        h = HF{}(key);
+        if (!p_buckets) {
+            return nullptr;
+        }
+        for (bucket *b = p_buckets[h % p_size]; b; b = b->next) {
+            if ((b->hash == h) && CF{}(key, b->value.key)) {
                 return b;
             }
         }
@@ -918,7 +996,7 @@ private:
 
     std::size_t p_size, p_nelems = 0;
 
-    bucket **p_buckets;
+    bucket **p_buckets = nullptr;
     bucket *p_unused = nullptr;
     chunk *p_chunks = nullptr;
 };
@@ -928,7 +1006,10 @@ private:
 template<std::size_t offset_basis, std::size_t prime>
 struct fnv1a {
     std::size_t operator()(char const *data) const {
-        std::size_t slen = std::strlen(data);
+        return (*this)(data, std::strlen(data));
+    }
+
+    std::size_t operator()(char const *data, std::size_t slen) const {
         std::size_t hash = offset_basis;
         for (std::size_t i = 0; i < slen; ++i) {
             hash ^= std::size_t(data[i]);
@@ -961,7 +1042,10 @@ static unsigned char const ph_lt[256] = {
 };
 struct pearson {
     std::size_t operator()(char const *data) const {
-        std::size_t slen = std::strlen(data);
+        return (*this)(data, std::strlen(data));
+    }
+
+    std::size_t operator()(char const *data, std::size_t slen) const {
         std::size_t hash = 0;
         auto *udata = pun<unsigned char const *>(data);
         for (std::size_t j = 0; j < sizeof(std::size_t); ++j) {
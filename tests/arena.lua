@@ -0,0 +1,115 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    struct apt {
+        int x, y;
+    };
+
+    struct aflex {
+        int n;
+        double d[];
+    };
+]]
+
+local ar = ffi.arena()
+assert(tostring(ar):match("^arena: "))
+
+-- variable length arrays keep their type and size
+local buf = ar:new("char[?]", 100)
+assert(ffi.typeof(buf) == ffi.typeof("char[?]"))
+assert(ffi.sizeof(buf) == 100)
+assert(ffi.sizeof(ar:new("int[?]", 7)) == ffi.sizeof("int") * 7)
+ffi.copy(buf, "hello")
+assert(ffi.string(buf) == "hello")
+
+local arr = ar:new("int[4]", { 1, 2, 3, 4 })
+assert(ffi.typeof(arr) == ffi.typeof("int[4]"))
+assert(arr[0] == 1 and arr[3] == 4)
+
+-- records are references, scalars are pointers
+local pt = ar:new("struct apt", 3, 4)
+assert(ffi.typeof(pt) == ffi.typeof("struct apt &"))
+assert(pt.x == 3 and pt.y == 4)
+assert(ffi.sizeof(pt) == ffi.sizeof("struct apt"))
+
+local iv = ar:new("int", 5)
+assert(ffi.typeof(iv) == ffi.typeof("int *"))
+assert(iv[0] == 5)
+
+local fl = ar:new("struct aflex", 3, { 3, { 1, 2, 3 } })
+assert(fl.n == 3 and fl.d[2] == 3)
+
+-- everything is aligned
+for i = 1, 16 do
+    local ld = ar:new("long double[?]", i)
+    local addr = ffi.tonumber(ffi.cast("uintptr_t", ld))
+    assert(addr % ffi.alignof("long double") == 0)
+end
+
+-- values larger than a chunk still work
+local big = ar:new("uint8_t[?]", 100000)
+ffi.fill(big, 100000, 7)
+assert(big[99999] == 7)
+
+-- resetting reuses the memory
+ar:reset()
+local a1 = ar:new("int[4]")
+ar:reset()
+local a2 = ar:new("int[4]", 5)
+assert(ffi.cast("void *", a1) == ffi.cast("void *", a2))
+assert(a2[0] == 5)
+
+-- arena values are never finalized
+local fin = 0
+local afin = ffi.metatype("struct aflex", {
+    __gc = function() fin = fin + 1 end
+})
+ar:new(afin, 1)
+collectgarbage()
+collectgarbage()
+assert(fin == 0)
+
+-- values keep their arena alive
+local function scoped_buf()
+    local sar = ffi.arena()
+    local sbuf = sar:new("char[?]", 64)
+    ffi.copy(sbuf, "hello")
+    return sbuf
+end
+local sbuf = scoped_buf()
+collectgarbage()
+collectgarbage()
+-- the same size of chunk, which would reuse the freed memory
+local oar = ffi.arena()
+ffi.fill(oar:new("char[?]", 64), 64, 0x78)
+assert(ffi.string(sbuf) == "hello")
+
+assert(not pcall(ar.new, ar, "void"))
+assert(not pcall(ar.new, ar, "int[?]", -1))
+assert(not pcall(ffi.arena, 0))
+assert(not pcall(ar.new, {}, "int"))
+
+-- running out of memory is an error, like with cffi.new
+local ok, err = pcall(ar.new, ar, "char[?]", 2^40)
+assert(not ok)
+local huge = ffi.arena(2^62)
+ok, err = pcall(huge.new, huge, "int")
+assert(not ok)
+assert(err:find("not enough memory"))
+
+-- to-be-closed arenas reset on scope exit
+if _VERSION ~= "Lua 5.1" and _VERSION ~= "Lua 5.2" and _VERSION ~= "Lua 5.3" then
+    local f = load [[
+        local ffi, ar = ...
+        local p
+        do
+            local sar <close> = ar
+            p = ffi.cast("void *", sar:new("int[4]"))
+        end
+        return p
+    ]]
+    ar:reset()
+    local p1 = f(ffi, ar)
+    local p2 = f(ffi, ar)
+    assert(p1 == p2)
+end
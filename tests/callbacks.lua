@@ -57,3 +57,150 @@ assert(not called2)
 st.cb()
 assert(called2)
 cb3:free()
+
+-- calls are reentrant, including ones with many arguments
+
+local rcb
+rcb = ffi.cast("int (*)(int, int)", function(n, x)
+    if n == 0 then
+        return x
+    end
+    local r = rcb(n - 1, x * 2)
+    assert(x == 2 ^ (5 - n))
+    return r
+end)
+assert(rcb(5, 1) == 32)
+rcb:free()
+
+local args = {}
+for i = 1, 20 do
+    args[i] = "int"
+end
+local rcb2
+rcb2 = ffi.cast(
+    "int (*)(" .. table.concat(args, ", ") .. ")",
+    function(n, ...)
+        local vals = {...}
+        if n > 0 then
+            local r = rcb2(n - 1, (unpack or table.unpack)(vals))
+            for i = 1, 19 do
+                assert(vals[i] == i)
+            end
+            return r + 1
+        end
+        local sum = 0
+        for i = 1, 19 do
+            sum = sum + vals[i]
+        end
+        return sum
+    end
+)
+assert(rcb2(3, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19) == 193)
+rcb2:free()
+
+-- freed callbacks are reused for the same signature
+
+local function addr(c)
+    return ffi.tonumber(ffi.cast("uintptr_t", ffi.cast("void *", c)))
+end
+
+local pcb = ffi.cast("int (*)(int)", function(x) return x + 1 end)
+local paddr = addr(pcb)
+assert(pcb(1) == 2)
+pcb:free()
+pcb = ffi.cast("int (*)(int)", function(x) return x * 10 end)
+assert(addr(pcb) == paddr)
+assert(pcb(2) == 20)
+-- other signatures do not take it
+local ocb = ffi.cast("int (*)(int, int)", function(a, b) return a - b end)
+assert(addr(ocb) ~= paddr)
+assert(ocb(5, 3) == 2)
+ocb:free()
+pcb:free()
+assert(not pcall(pcb, 1))
+
+-- copies of a handle share the callback, so it is freed only once, and is
+-- not reused while a copy still refers to it
+local fcb = ffi.cast("int (*)(int)", function(x) return x + 100 end)
+local fcopy = ffi.cast("int (*)(int)", fcb)
+assert(fcopy(1) == 101)
+fcb:free()
+assert(not pcall(fcopy, 1))
+local ok, err = pcall(fcopy.free, fcopy)
+assert(not ok and err:match("callback already freed"))
+assert(not pcall(fcopy.set, fcopy, function() end))
+local c1 = ffi.cast("int (*)(int)", function(x) return x + 1 end)
+local c2 = ffi.cast("int (*)(int)", function(x) return x + 2 end)
+assert(addr(c1) ~= addr(fcopy))
+assert(c1(0) == 1 and c2(0) == 2)
+c1:free()
+c2:free()
+-- once the copy is gone, the callback goes back to the pool
+fcopy = nil
+collectgarbage()
+collectgarbage()
+local c3 = ffi.cast("int (*)(int)", function(x) return x + 3 end)
+local c4 = ffi.cast("int (*)(int)", function(x) return x + 4 end)
+local c5 = ffi.cast("int (*)(int)", function(x) return x + 5 end)
+assert(c3(0) == 3 and c4(0) == 4 and c5(0) == 5)
+c3:free()
+c4:free()
+c5:free()
+
+-- the pool can be bounded
+local oldmax = ffi.cbpool(0)
+assert(ffi.cbpool() == 0)
+pcb = ffi.cast("int (*)(int)", function(x) return x end)
+paddr = addr(pcb)
+pcb:free()
+assert(ffi.cbpool(oldmax) == 0)
+assert(ffi.cbpool() == oldmax)
+assert(not pcall(ffi.cbpool, -1))
+
+-- reused callbacks work after their previous handle is gone
+local cbs = {}
+for i = 1, 8 do
+    cbs[i] = ffi.cast("int (*)(int)", function(x) return x + i end)
+end
+for i = 1, 8 do
+    assert(cbs[i](1) == i + 1)
+    cbs[i]:free()
+end
+cbs = nil
+collectgarbage()
+for i = 1, 8 do
+    local c = ffi.cast("int (*)(int)", function(x) return x * i end)
+    assert(c(3) == 3 * i)
+    c:free()
+end
+
+-- scalar-only signatures, with results converted on the fast path
+
+local scb = ffi.cast(
+    "short (*)(char, unsigned char, float, bool, long long)",
+    function(c, uc, f, b, ll)
+        assert(c == -3)
+        assert(uc == 250)
+        assert(f == 0.5)
+        assert(b == true)
+        assert(ll == 1 or ffi.tonumber(ll) == 1)
+        return -7
+    end
+)
+assert(scb(-3, 250, 0.5, true, 1) == -7)
+scb:free()
+
+local bcb = ffi.cast("bool (*)(int const *, double)", function(p, d)
+    return p[0] == d
+end)
+local iv = ffi.new("int[1]", 42)
+assert(bcb(iv, 42) == true)
+assert(bcb(iv, 41) == false)
+bcb:free()
+
+-- cdata results still go through the generic conversion
+local ucb = ffi.cast("unsigned long long (*)(void)", function()
+    return ffi.new("unsigned long long", 5)
+end)
+assert(ffi.tonumber(ucb()) == 5)
+ucb:free()
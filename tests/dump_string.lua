@@ -52,3 +52,58 @@ local p = ffi.cast("struct bar const *", b)
 assert(p.x == 16)
 assert(ffi.string(p.s, 2) == "ab")
 assert(ffi.string(p.s) == "abc")
+
+-- owned strings; zero-copy on 5.5, a plain copy elsewhere
+
+local body = ("0123456789abcdef"):rep(8)
+local buf = ffi.new("char[?]", #body + 1, body)
+local freed = false
+ffi.gc(buf, function() freed = true end)
+
+assert(ffi.string(buf, #body, buf) == body)
+assert(ffi.string(buf, 10, buf) == "0123456789")
+-- no terminating zero at the end, gets copied
+assert(ffi.string(buf, 64, buf) == body:sub(1, 64))
+
+local s = ffi.string(buf, #body, buf)
+buf = nil
+collectgarbage()
+collectgarbage()
+assert(s == body)
+
+local ext = (_VERSION == "Lua 5.5") and (jit == nil)
+assert(freed == not ext)
+
+-- the owner is let go once the string is collected
+s = nil
+collectgarbage()
+collectgarbage()
+collectgarbage()
+assert(freed)
+
+-- pointers have no known bound, so the data is copied and not owned
+buf = ffi.new("char[?]", #body + 1, body)
+freed = false
+ffi.gc(buf, function() freed = true end)
+s = ffi.string(ffi.cast("char *", buf), #body, buf)
+buf = nil
+collectgarbage()
+collectgarbage()
+assert(freed)
+assert(s == body)
+
+-- unless the caller vouches for the byte after the data
+buf = ffi.new("char[?]", #body + 1, body)
+freed = false
+ffi.gc(buf, function() freed = true end)
+s = ffi.string(ffi.cast("char *", buf), #body, buf, true)
+buf = nil
+collectgarbage()
+collectgarbage()
+assert(freed == not ext)
+assert(s == body)
+s = nil
+collectgarbage()
+collectgarbage()
+collectgarbage()
+assert(freed)
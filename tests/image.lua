@@ -0,0 +1,193 @@
+local ffi = require("cffi")
+
+local defs = [[
+    struct img_s {
+        int x;
+        struct {
+            char y;
+            double z;
+        };
+        union img_u *up;
+        int arr[];
+    };
+    union img_u {
+        int a;
+        float b;
+    };
+    struct img_n {
+        struct img_n *next;
+        union img_u u[2];
+        enum img_e e;
+    };
+    enum img_e {
+        IMG_A = 5, IMG_B
+    };
+    typedef struct img_s img_t;
+    typedef struct {
+        int q;
+        struct img_n n;
+    } img_anon;
+    typedef int (*img_cb)(void *, int);
+    int img_abs(int v) __asm__("abs");
+    int img_printf(char const *fmt, ...) __asm__("printf");
+    int const *volatile img_ptrs[3];
+]]
+
+-- dumping given declarations does not declare them
+local img = ffi.dump_image(defs)
+assert(type(img) == "string")
+assert(not pcall(ffi.typeof, "img_t"))
+
+-- the same declarations under different names, for comparison
+ffi.cdef((defs:gsub("img_", "ref_"):gsub("IMG_", "REF_")))
+
+ffi.cdef_image(img)
+
+for i, tp in ipairs {
+    "struct img_s", "union img_u", "struct img_n", "img_anon", "img_cb"
+} do
+    local rtp = tp:gsub("img_", "ref_")
+    assert(ffi.sizeof(tp) == ffi.sizeof(rtp))
+    assert(ffi.alignof(tp) == ffi.alignof(rtp))
+    if tp ~= "img_anon" then
+        assert(tostring(ffi.typeof(tp)):gsub("img_", "ref_")
+            == tostring(ffi.typeof(rtp)))
+    end
+end
+for i, fld in ipairs { "x", "y", "z", "up", "arr" } do
+    assert(ffi.offsetof("img_t", fld) == ffi.offsetof("ref_t", fld))
+end
+assert(ffi.offsetof("img_anon", "n") == ffi.offsetof("ref_anon", "n"))
+assert(ffi.sizeof("img_t", 4) == ffi.sizeof("ref_t", 4))
+
+assert(ffi.C.IMG_A == 5)
+assert(ffi.C.IMG_B == 6)
+
+local s = ffi.new("img_t", 2)
+s.x, s.y, s.z = 1, 2, 3.5
+s.arr[1] = 10
+assert(s.x == 1 and s.y == 2 and s.z == 3.5 and s.arr[1] == 10)
+
+local n = ffi.new("struct img_n")
+n.next = n
+n.u[1].b = 0.5
+n.e = ffi.C.IMG_B
+assert(n.next.u[1].b == 0.5)
+assert(n.e == 6)
+
+assert(ffi.C.img_abs(-5) == 5)
+assert(ffi.C.img_printf("%s", "") == 0)
+
+-- loading again redefines the structs, like cdef would
+local ok, err = pcall(ffi.cdef_image, img)
+assert(not ok)
+assert(err:find("redefined"))
+
+-- anonymous types get new names, so they don't clash
+local aimg = ffi.dump_image("typedef struct { int a, b; } img_anon2;")
+ffi.cdef_image(aimg)
+assert(ffi.sizeof("img_anon2") == 2 * ffi.sizeof("int"))
+
+-- opaque declarations can be completed by an image
+ffi.cdef("struct img_late;")
+ffi.cdef_image(ffi.dump_image("struct img_late { short a; }; "))
+assert(ffi.sizeof("struct img_late") == ffi.sizeof("short"))
+
+-- declarations outside the image cannot be referred to
+local ok, err = pcall(ffi.dump_image, "struct img_s *img_get(void);")
+assert(not ok)
+assert(err:find("outside of the image"))
+
+-- broken images are rejected and declare nothing
+local bimg = ffi.dump_image("struct img_bad { int a; }; typedef int img_bad_t;")
+assert(not pcall(ffi.cdef_image, "not an image"))
+for i = 1, #bimg - 1 do
+    assert(not pcall(ffi.cdef_image, bimg:sub(1, i)))
+end
+assert(not pcall(ffi.typeof, "img_bad_t"))
+assert(not pcall(ffi.typeof, "struct img_bad"))
+ffi.cdef_image(bimg)
+assert(ffi.sizeof("img_bad_t") == ffi.sizeof("int"))
+
+-- the encoded builtin type of a typedef, and the record bits
+local function code_of(tp)
+    local dimg = ffi.dump_image("typedef " .. tp .. " img_code_t;")
+    local _, e = dimg:find("img_code_t", 1, true)
+    return dimg:sub(e + 1, e + 1)
+end
+local function bits_of(decl)
+    local dimg = ffi.dump_image(decl)
+    local _, e = dimg:find("struct img_rb", 1, true)
+    return dimg:sub(e + 1, e + 1)
+end
+-- the whole encoded type, declared as img_at
+local function type_of(decl)
+    local dimg = ffi.dump_image("typedef " .. decl .. ";")
+    local _, e = dimg:find("img_at", 1, true)
+    return dimg:sub(e + 1)
+end
+local vcode, icode = code_of("void"), code_of("int")
+local opaque = bits_of("struct img_rb;")
+local complete = bits_of("struct img_rb { int a; };")
+
+-- images the parser could not have produced are rejected
+local function broken(decls, from, to)
+    local mimg = ffi.dump_image(decls)
+    local a, b = mimg:find(from, 1, true)
+    assert(a)
+    mimg = mimg:sub(1, a - 1) .. to .. mimg:sub(b + 1)
+    local ok, err = pcall(ffi.cdef_image, mimg)
+    assert(not ok)
+    assert(err:find("invalid declaration image"))
+end
+-- void parameters and variables
+broken("void img_bvp(int img_par);", "img_par" .. icode, "img_par" .. vcode)
+broken("int img_bvv;", "img_bvv\0\0\0\0" .. icode, "img_bvv\0\0\0\0" .. vcode)
+-- opaque records passed or returned by value
+broken(
+    "struct img_rb { int a; }; void img_bop(struct img_rb p);",
+    "struct img_rb" .. complete, "struct img_rb" .. opaque
+)
+broken(
+    "struct img_rb { int a; }; struct img_rb img_bor(void);",
+    "struct img_rb" .. complete, "struct img_rb" .. opaque
+)
+assert(not pcall(ffi.typeof, "struct img_rb"))
+-- unknown array bounds with a size, or not at the end of a struct
+local int3 = type_of("int img_at[3]")
+local intv, intn = type_of("int img_at[?]"), type_of("int img_at[]")
+broken(
+    "struct img_rv { int n; int a[3]; };",
+    int3, int3:sub(1, 2) .. intv:sub(3, 3) .. int3:sub(4)
+)
+broken("struct img_rv { int a[3]; int n; };", int3, intv)
+broken("struct img_rv { int a[3]; int n; };", int3, intn)
+-- or as the only member of a struct, leaving nothing to lay out
+broken("struct img_rv { int a[3]; };", int3, intv)
+-- arrays of functions
+broken(
+    "typedef int img_at[3];",
+    int3, int3:sub(1, 11) .. type_of("int img_at(void)")
+)
+-- and arrays whose size wraps around
+local quarter = (ffi.sizeof("size_t") == 8) and "0x4000000000000000ULL"
+    or "0x40000000"
+local size5 = type_of("char img_at[5]"):sub(4, 11)
+local huge = type_of("char img_at[" .. quarter .. "]"):sub(4, 11)
+broken("typedef int img_at[3];", int3, int3:sub(1, 3) .. huge .. int3:sub(12))
+broken(
+    "struct img_rh { int a[3]; }; typedef struct img_rh img_at[5];",
+    size5, huge
+)
+-- but like in C, these may refer to opaque records
+ffi.cdef_image(ffi.dump_image([[
+    struct img_ro;
+    typedef struct img_ro img_ro_t;
+    extern struct img_ro img_rov;
+    typedef void img_void_t;
+    struct img_rvla { int n; int a[?]; };
+]]))
+assert(ffi.typeof("img_ro_t") == ffi.typeof("struct img_ro"))
+
+-- the whole store can be dumped too
+assert(#ffi.dump_image() > #img)
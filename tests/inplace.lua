@@ -0,0 +1,69 @@
+local ffi = require("cffi")
+
+-- in-place arithmetic writes into the first operand and returns it
+
+local acc = ffi.new("uint64_t", 0)
+assert(ffi.iadd(acc, 5) == acc)
+assert(ffi.tonumber(acc) == 5)
+assert(ffi.typeof(acc) == ffi.typeof("uint64_t"))
+
+ffi.iadd(acc, ffi.new("int", 10))
+ffi.isub(acc, 3)
+ffi.imul(acc, 4)
+assert(ffi.tonumber(acc) == 48)
+ffi.idiv(acc, 5)
+assert(ffi.tonumber(acc) == 9)
+ffi.imod(acc, 4)
+assert(ffi.tonumber(acc) == 1)
+
+-- bitwise operations
+ffi.ior(acc, 6)
+assert(ffi.tonumber(acc) == 7)
+ffi.iand(acc, 5)
+assert(ffi.tonumber(acc) == 5)
+ffi.ixor(acc, 3)
+assert(ffi.tonumber(acc) == 6)
+ffi.ishl(acc, 4)
+assert(ffi.tonumber(acc) == 96)
+ffi.ishr(acc, 5)
+assert(ffi.tonumber(acc) == 3)
+ffi.ishl(acc, -1)
+assert(ffi.tonumber(acc) == 1)
+
+-- the same results as the operators
+local u = ffi.new("uint64_t", 0)
+ffi.isub(u, 1)
+assert(u == ffi.new("uint64_t", -1))
+ffi.iadd(u, 1)
+assert(ffi.tonumber(u) == 0)
+local i = ffi.new("int64_t", -7)
+ffi.idiv(i, 2)
+assert(ffi.tonumber(i) == -3)
+ffi.ishr(i, 1)
+assert(ffi.tonumber(i) == -2)
+
+-- smaller types are truncated like in C
+local c = ffi.new("uint8_t", 250)
+ffi.iadd(c, 10)
+assert(ffi.tonumber(c) == 4)
+local s = ffi.new("int16_t", 32767)
+ffi.iadd(s, 1)
+assert(ffi.tonumber(s) == -32768)
+
+-- a simple hash, with no allocations in the loop
+local h = ffi.new("uint64_t", 14695981)
+local ref = ffi.new("uint64_t", 14695981)
+local prime = ffi.new("uint64_t", 1099511628211)
+for b in ("hello world"):gmatch(".") do
+    ffi.iadd(ffi.imul(h, prime), b:byte())
+    ref = ref * prime + b:byte()
+end
+assert(h == ref)
+
+-- invalid targets
+assert(not pcall(ffi.iadd, 5, 1))
+assert(not pcall(ffi.iadd, ffi.new("double", 1), 1))
+assert(not pcall(ffi.iadd, ffi.new("int *"), 1))
+assert(not pcall(ffi.iadd, ffi.new("const int", 1), 1))
+assert(not pcall(ffi.iadd, acc, "foo"))
+assert(not pcall(ffi.ishl, acc, 1.5))
@@ -49,3 +49,27 @@ assert(x.y == 1000)
 assert(x:sum() == 1500)
 
 assert(new_called == 2)
+
+-- finalizers from metatypes run even though plain cdata are not finalized
+ffi.cdef [[
+    typedef struct gcfoo {
+        int x;
+    } gcfoo;
+]]
+
+local gc_called = 0
+local gcfoo = ffi.metatype("gcfoo", {
+    __gc = function(self)
+        assert(self.x == 42)
+        gc_called = gc_called + 1
+    end
+})
+
+do
+    local a = gcfoo(42)
+    local b = ffi.new("gcfoo", 42)
+    local c = ffi.gc(ffi.new("gcfoo", 42), nil)
+end
+collectgarbage()
+collectgarbage()
+assert(gc_called == 2)
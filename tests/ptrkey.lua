@@ -0,0 +1,71 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    struct ptrkey_test {
+        int *p;
+        void *q;
+    };
+]]
+
+local arr = ffi.new("int[4]")
+local s = ffi.new("struct ptrkey_test", { arr + 1, arr + 1 })
+
+-- pointer keys identify the address, regardless of the type or object
+
+assert(not rawequal(s.p, s.p))
+assert(ffi.key(s.p) == ffi.key(s.p))
+assert(ffi.key(s.p) == ffi.key(s.q))
+assert(ffi.key(s.p) == ffi.key(arr + 1))
+assert(ffi.key(s.p) ~= ffi.key(arr))
+assert(ffi.key(arr) == ffi.key(ffi.cast("void *", arr)))
+assert(type(ffi.key(s.p)) == "userdata")
+
+local t = {}
+t[ffi.key(s.p)] = "x"
+assert(t[ffi.key(s.q)] == "x")
+assert(t[ffi.key(arr)] == nil)
+
+-- null pointers
+assert(ffi.key(nil) == ffi.key(ffi.nullptr))
+assert(ffi.key(ffi.cast("int *", 0)) == ffi.key(nil))
+
+-- light userdata pass through
+local k = ffi.key(arr)
+assert(ffi.key(k) == k)
+
+assert(not pcall(ffi.key, 5))
+assert(not pcall(ffi.key, "foo"))
+assert(not pcall(ffi.key, ffi.new("int", 5)))
+
+-- pointer interning hands out the same cdata for the same type and address
+
+assert(ffi.ptrintern() == false)
+assert(ffi.ptrintern(true) == false)
+assert(ffi.ptrintern() == true)
+
+assert(rawequal(s.p, s.p))
+assert(rawequal(s.q, s.q))
+-- other types at the same address are other objects
+assert(not rawequal(s.p, s.q))
+assert(ffi.typeof(s.q) == ffi.typeof("void *"))
+
+local cache = {}
+cache[s.p] = true
+assert(cache[s.p])
+
+-- other addresses
+s.p = arr + 2
+assert(rawequal(s.p, s.p))
+assert(ffi.key(s.p) == ffi.key(arr + 2))
+
+-- entries do not keep the cdata alive
+local p = s.p
+p = nil
+collectgarbage()
+collectgarbage()
+assert(ffi.key(s.p) == ffi.key(arr + 2))
+
+-- disabling drops the table
+assert(ffi.ptrintern(false) == true)
+assert(ffi.ptrintern() == false)
+assert(not rawequal(s.p, s.p))
@@ -65,3 +65,8 @@ ffi.cdef [[
 ffi.cdef [[
     enum {QUX = 3};
 ]]
+
+-- function cdata are cached per library and declaration, so the same
+-- object is returned for every lookup
+assert(rawequal(ffi.C.malloc, ffi.C.malloc))
+assert(not rawequal(ffi.C.malloc, ffi.C.free))
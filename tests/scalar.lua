@@ -25,6 +25,71 @@ local c = -ffi.cast("int", 150)
 
 assert(ffi.tonumber(a + b + c) == 300)
 
+-- 64-bit arithmetic
+
+local u = ffi.new("uint64_t", 10)
+local i = ffi.new("int64_t", -10)
+local umax = ffi.new("uint64_t", -1)
+
+-- the type of a 64-bit operand is kept
+assert(ffi.typeof(u + 1) == ffi.typeof(u))
+assert(ffi.typeof(i + 1) == ffi.typeof(i))
+assert(ffi.typeof(ffi.new("int", 1) + 1) == ffi.typeof("long long"))
+-- unsigned wins
+assert(ffi.typeof(i + u) == ffi.typeof(u))
+assert(ffi.typeof(ffi.new("unsigned int", 1) + i) == ffi.typeof(i))
+assert(
+    ffi.typeof(ffi.new("unsigned long long", 1) + i) ==
+    ffi.typeof("unsigned long long")
+)
+assert(ffi.tonumber(i + u) == 0)
+
+assert(ffi.tonumber(u * 3 - 5) == 25)
+assert(ffi.tonumber(i / 3) == -3)
+assert(ffi.tonumber(i % 3) == -1)
+assert(ffi.tonumber(u / 3) == 3)
+assert(ffi.tonumber(u % 3) == 1)
+assert(i < 0)
+-- compared as unsigned
+assert(i > u)
+assert(i == u - 20)
+assert(not (u <= 9))
+assert(u > 9)
+
+-- wrapping around and the undefined cases
+local imin = ffi.new("int64_t", 1) * 2^62 * 2
+assert(imin < 0)
+assert(imin - 1 > 0)
+assert(imin / -1 == imin)
+assert(ffi.tonumber(imin % -1) == 0)
+assert(i / 0 == imin)
+assert(i % 0 == imin)
+assert(u / 0 == umax)
+assert(u % 0 == umax)
+assert(ffi.new("uint64_t", 0) - 1 == umax)
+
+-- shifts, with negative and out of range counts
+if _VERSION ~= "Lua 5.1" and _VERSION ~= "Lua 5.2" then
+    local f = load [[
+        local ffi, u, i = ...
+        local n = ffi.tonumber
+        assert(n(u << 2) == 40)
+        assert(n(u >> 1) == 5)
+        assert(n(u << -1) == 5)
+        assert(n(u >> -2) == 40)
+        assert(n(u << 64) == 0)
+        assert(n(u >> 100) == 0)
+        assert(n(i >> 64) == -1)
+        assert(n(i >> 1) == -5)
+        assert(ffi.typeof(i << 1) == ffi.typeof(i))
+        assert(n(u ~ 3) == 9)
+        assert(n(u & 3) == 2)
+        assert(n(u | 5) == 15)
+        assert(not pcall(function() return u << 1.5 end))
+    ]]
+    f(ffi, u, i)
+end
+
 -- pointer addition
 
 local a = ffi.cast("int *", 0)
@@ -11,3 +11,7 @@ assert(ret == 11)
 
 local ret = ffi.tonumber(L.test_strlen_void("hello world"))
 assert(ret == 11)
+
+-- redirected declarations get their own function objects
+assert(rawequal(L.test_strlen, L.test_strlen))
+assert(not rawequal(L.test_strlen, L.test_strlen_void))
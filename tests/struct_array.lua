@@ -199,3 +199,100 @@ assert(ffi.string(x.buf2 + 5) == "flex")
 assert(x.buf[4] == (x.buf + 4)[0])
 assert(x.buf2[4] == (x.buf2 + 4)[0])
 assert(x.buf[4] == string.byte("o"))
+
+-- many fields, including transparent members and missing names
+
+local flds = {}
+for i = 1, 40 do
+    flds[#flds + 1] = ("int f%d;"):format(i)
+    if i == 20 then
+        flds[#flds + 1] = "struct { short t1; union { char t2; long t3; }; };"
+    end
+end
+ffi.cdef(("struct many { %s };"):format(table.concat(flds, " ")))
+
+local x = ffi.new("struct many")
+for i = 1, 40 do
+    x["f" .. i] = i
+end
+x.t1 = 41
+x.t3 = 42
+for i = 1, 40 do
+    assert(x["f" .. i] == i)
+    assert(ffi.offsetof("struct many", "f" .. i) == (i - 1) * ffi.sizeof("int")
+        + ((i > 20) and ffi.sizeof("struct { short a; long b; }") or 0))
+end
+assert(x.t1 == 41)
+assert(ffi.tonumber(x.t3) == 42)
+assert(ffi.offsetof("struct many", "t2") == ffi.offsetof("struct many", "t3"))
+assert(ffi.offsetof("struct many", "f") == nil)
+assert(ffi.offsetof("struct many", "f41") == nil)
+assert(ffi.offsetof("struct many", "f1\0") == nil)
+assert(not pcall(function() return x.f0 end))
+
+-- pointers and references obtained from fields and elements are created
+-- without a finalizer, they must still behave like any other cdata
+ffi.cdef [[
+    struct lnode {
+        struct lnode *next;
+        int v;
+    };
+]]
+
+local nodes = ffi.new("struct lnode[4]")
+for i = 0, 2 do
+    nodes[i].next = nodes + (i + 1)
+    nodes[i].v = i + 1
+end
+local p, n = nodes + 0, 0
+while p ~= ffi.nullptr do
+    n = n + p.v
+    p = p.next
+end
+assert(n == 6)
+
+local nx = nodes[0].next
+assert(nx == nodes + 1)
+assert(nodes + 1 == nx)
+assert(nx + 1 == nodes[1].next)
+assert(nx > nodes + 0)
+assert(ffi.istype("struct lnode *", nx))
+assert(ffi.typeof(nx) == ffi.typeof("struct lnode *"))
+assert(tostring(ffi.typeof(nodes[1])) == "ctype<struct lnode &>")
+assert(getmetatable(nx) == getmetatable(nodes))
+assert(nx.next.next.next == ffi.nullptr)
+local r = nodes[2]
+r.v = 10
+assert(nodes[2].v == 10)
+
+-- finalizers may still be set on them
+local fin = 0
+do
+    local q = nodes[0].next
+    ffi.gc(q, function() fin = fin + 1 end)
+    q = nil
+end
+collectgarbage()
+collectgarbage()
+assert(fin == 1)
+
+-- finalizers are replaced and unset, and run only once
+fin = 0
+do
+    local q = ffi.new("int")
+    ffi.gc(q, function() fin = fin + 10 end)
+    ffi.gc(q, function() fin = fin + 1 end)
+    local u = ffi.gc(ffi.new("int"), function() fin = fin + 100 end)
+    ffi.gc(u, nil)
+end
+collectgarbage()
+collectgarbage()
+assert(fin == 1)
+
+-- values needing more than the usual alignment are still aligned
+for i = 1, 8 do
+    local ld = ffi.new("long double", i)
+    local addr = ffi.tonumber(ffi.cast("uintptr_t", ffi.addressof(ld)))
+    assert(addr % ffi.alignof(ld) == 0)
+    assert(ffi.tonumber(ld) == i)
+end
@@ -168,3 +168,107 @@ assert(x.a == 3)
 -- test initialization of second field
 x = ffi.new("union uinit2", { b = 3.14 })
 assert(x.b == 3.14)
+
+-- arithmetic arrays are converted in bulk, make sure values that are not
+-- plain numbers still go through the regular conversions
+local vals = { 1, 2.75, true, ffi.new("int", 4), 5 }
+x = ffi.new("int[5]", vals)
+assert(x[0] == 1 and x[1] == 2 and x[2] == 1 and x[3] == 4 and x[4] == 5)
+x = ffi.new("double[?]", 6, vals)
+assert(x[1] == 2.75 and x[2] == 1 and x[3] == 4 and x[5] == 0)
+x = ffi.new("unsigned char[3]", { 255, 256, -1 })
+assert(x[0] == 255 and x[1] == 0 and x[2] == 255)
+x = ffi.new("int16_t[2][2]", { { 1, 2 }, { 3, 4 } })
+assert(x[0][1] == 2 and x[1][0] == 3)
+assert(not pcall(ffi.new, "float[2]", { 1, 2, 3 }))
+assert(not pcall(ffi.new, "int[2]", { 1, "x" }))
+
+-- filling existing buffers
+local t = {}
+for i = 1, 100 do t[i] = i end
+x = ffi.new("int32_t[100]")
+ffi.fromtable(x, t)
+for i = 1, 100 do assert(x[i - 1] == i) end
+ffi.fromtable(ffi.cast("int32_t *", x) + 10, { 7, 8 })
+assert(x[9] == 10 and x[10] == 7 and x[11] == 8 and x[12] == 13)
+ffi.fromtable(x, t, 0)
+assert(x[0] == 1)
+ffi.fromtable(x, { 5, 6, 7 }, 2)
+assert(x[0] == 5 and x[1] == 6 and x[2] == 3)
+x = ffi.new("struct sinit[2]")
+ffi.fromtable(x, { { 1, 2 }, { x = 3, z = 4 } })
+assert(x[0].x == 1 and x[0].y == 2 and x[1].x == 3 and x[1].z == 4)
+x = ffi.new("double[?]", 2)
+assert(not pcall(ffi.fromtable, x, { 1, 2, 3 }))
+assert(not pcall(ffi.fromtable, ffi.new("int const[2]"), { 1 }))
+assert(not pcall(ffi.fromtable, ffi.new("int"), { 1 }))
+assert(not pcall(ffi.fromtable, ffi.new("void *"), { 1 }))
+
+-- exporting arrays into tables
+x = ffi.new("int32_t[100]", t)
+local tt = ffi.totable(x, 100)
+assert(#tt == 100)
+for i = 1, 100 do assert(tt[i] == i) end
+tt = ffi.totable(ffi.cast("int32_t *", x), 3, 10)
+assert(#tt == 3 and tt[1] == 11 and tt[3] == 13)
+assert(#ffi.totable(x, 0) == 0)
+assert(#ffi.totable(x, 0, 100) == 0)
+assert(not pcall(ffi.totable, x, 101))
+assert(not pcall(ffi.totable, x, 2, 99))
+assert(not pcall(ffi.totable, ffi.new("int"), 1))
+tt = ffi.totable(ffi.new("double[?]", 3, { 0.5, 1.5, 2.5 }), 3)
+assert(tt[1] == 0.5 and tt[2] == 1.5 and tt[3] == 2.5)
+tt = ffi.totable(ffi.new("bool[2]", { true, false }), 2)
+assert(tt[1] == true and tt[2] == false)
+tt = ffi.totable(ffi.new("struct sinit[2]", { { 1 }, { 2 } }), 2)
+assert(tt[1].x == 1 and tt[2].x == 2)
+
+local a, b, c = ffi.unpack(x, 3)
+assert(a == 1 and b == 2 and c == 3)
+a, b = ffi.unpack(x, 2, 98)
+assert(a == 99 and b == 100)
+assert(select("#", ffi.unpack(x, 0)) == 0)
+assert(not pcall(ffi.unpack, x, 3, 98))
+
+-- iterators
+
+local n = 0
+for i, v in ffi.ipairs(x) do
+    assert(i == n and v == n + 1)
+    n = n + 1
+end
+assert(n == 100)
+n = 0
+for i, v in ffi.ipairs(ffi.cast("int32_t *", x), 3) do
+    assert(v == i + 1)
+    n = n + 1
+end
+assert(n == 3)
+for i, v in ffi.ipairs(x, 0) do assert(false) end
+assert(not pcall(ffi.ipairs, x, 101))
+assert(not pcall(ffi.ipairs, ffi.cast("int32_t *", x)))
+assert(not pcall(ffi.ipairs, ffi.new("int"), 1))
+
+local ev = {}
+for i, v in ffi.each("int32_t", ffi.cast("void *", x), 4) do
+    ev[#ev + 1] = v
+end
+assert(#ev == 4 and ev[1] == 1 and ev[4] == 4)
+for i, v in ffi.each(ffi.typeof("uint32_t"), x + 10, 2) do
+    assert(v == i + 11)
+end
+assert(not pcall(ffi.each, "void", x, 1))
+
+-- elements are converted like when indexing
+local sa = ffi.new("struct sinit[2]", { { 1 }, { 2 } })
+for i, v in ffi.ipairs(sa) do
+    v.x = v.x * 10
+end
+assert(sa[0].x == 10 and sa[1].x == 20)
+for i, v in ffi.ipairs(ffi.new("bool[2]", { true, false })) do
+    assert(v == (i == 0))
+end
+local pa = ffi.new("int32_t *[2]", { x, x + 1 })
+for i, v in ffi.ipairs(pa) do
+    assert(v[0] == i + 1)
+end
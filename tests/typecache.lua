@@ -0,0 +1,96 @@
+local ffi = require("cffi")
+
+-- parsed types are cached by their string and parameters
+
+assert(rawequal(ffi.typeof("int *"), ffi.typeof("int *")))
+assert(not rawequal(ffi.typeof("int *"), ffi.typeof("int*")))
+assert(ffi.typeof("int *") == ffi.typeof("int*"))
+
+assert(rawequal(ffi.typeof("int[$]", 4), ffi.typeof("int[$]", 4)))
+assert(not rawequal(ffi.typeof("int[$]", 4), ffi.typeof("int[$]", 8)))
+assert(ffi.sizeof(ffi.typeof("int[$]", 8)) == ffi.sizeof("int") * 8)
+-- these look the same when formatted with 14 digits
+assert(ffi.sizeof(ffi.typeof("char[$]", 100000000000000)) == 100000000000000)
+assert(ffi.sizeof(ffi.typeof("char[$]", 100000000000001)) == 100000000000001)
+assert(ffi.sizeof(ffi.typeof("char[$]", 2^53)) == 2^53)
+assert(ffi.sizeof(ffi.typeof("char[$]", 2^53 + 2)) == 2^53 + 2)
+
+-- types as parameters are never cached
+local ip = ffi.typeof("int")
+assert(not rawequal(ffi.typeof("$ *", ip), ffi.typeof("$ *", ip)))
+assert(ffi.typeof("$ *", ip) == ffi.typeof("int *"))
+
+-- anonymous declarations create a new type every time
+local s1 = ffi.typeof("struct { int x; }")
+local s2 = ffi.typeof("struct { int x; }")
+assert(not rawequal(s1, s2))
+assert(s1 ~= s2)
+
+-- cached types still see later completion of opaque structs
+ffi.cdef [[ struct tcache_foo; ]]
+local fp = ffi.typeof("struct tcache_foo *")
+assert(rawequal(fp, ffi.typeof("struct tcache_foo *")))
+ffi.cdef [[ struct tcache_foo { int x, y; }; ]]
+local p = ffi.cast("struct tcache_foo *", ffi.new("struct tcache_foo"))
+assert(rawequal(fp, ffi.typeof("struct tcache_foo *")))
+assert(ffi.sizeof(p[0]) == ffi.sizeof("int") * 2)
+
+-- the cache does not grow unbounded, generated types still work
+for i = 1, 1000 do
+    assert(ffi.sizeof("char[" .. i .. "]") == i)
+end
+for i = 1, 1000 do
+    assert(ffi.sizeof(ffi.typeof("char[$]", i)) == i)
+end
+
+-- types of sized arrays made on the fly are not kept by the store, the
+-- values hold on to them instead
+local vals = {}
+for i = 1, 1000 do
+    vals[i] = ffi.new("char[" .. i .. "]")
+end
+collectgarbage()
+collectgarbage()
+for i = 1, 1000 do
+    assert(ffi.sizeof(vals[i]) == i)
+    assert(tostring(ffi.typeof(vals[i])) == "ctype<char[" .. i .. "]>")
+end
+vals = nil
+
+-- named ones are kept like any other declared type
+ffi.cdef [[ typedef char tcache_buf[16]; ]]
+local tb = ffi.new("tcache_buf")
+assert(ffi.typeof(tb) == ffi.typeof("char[16]"))
+assert(rawequal(ffi.typeof("tcache_buf"), ffi.typeof("tcache_buf")))
+
+-- types derived from such types outlive what they were derived from
+local function inner(n)
+    local arr = ffi.new(ffi.typeof("int[3][$]", n))
+    return ffi.typeof(arr[1]), ffi.typeof(arr + 1)
+end
+local rowt, rowpt = inner(5)
+collectgarbage()
+collectgarbage()
+assert(tostring(rowt) == "ctype<int (&)[5]>")
+assert(rowpt == ffi.typeof("int (*)[5]"))
+local row = ffi.new("int[5]", 1, 2, 3, 4, 42)
+local rp = ffi.cast(rowpt, row)
+assert(rp[0][4] == 42)
+assert(ffi.istype(rowpt, rp))
+
+-- equal types share one interned instance, which must not change how
+-- types compare
+assert(ffi.typeof("int const *") ~= ffi.typeof("int *"))
+assert(ffi.typeof("int[4]") ~= ffi.typeof("int[8]"))
+assert(ffi.typeof("int (*)(int)") == ffi.typeof("$ (*)(int)", ip))
+assert(ffi.typeof("int (*)(int)") ~= ffi.typeof("int (*)(int, int)"))
+assert(ffi.typeof("int (*)(int, ...)") ~= ffi.typeof("int (*)(int)"))
+assert(ffi.istype("int const", ffi.new("int")))
+assert(not ffi.istype("int *", ffi.new("int const *")))
+assert(ffi.istype("int (*)(int)", ffi.new("int (*)(int)")))
+assert(ffi.istype("struct tcache_foo", p[0]))
+
+local a = ffi.new("int[2]")
+local pa = ffi.cast("int *", a)
+assert(ffi.typeof(pa) == ffi.typeof("int *"))
+assert(ffi.typeof(pa + 1) == ffi.typeof(pa))
@@ -0,0 +1,46 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    struct u64s {
+        int64_t i;
+        uint64_t u;
+        long long ll;
+    };
+]]
+
+local x = ffi.new("struct u64s", { -5, 5, 123456789 })
+local big = ffi.new("struct u64s")
+local maxu = ffi.new("uint64_t", -1)
+big.u = maxu
+
+-- disabled by default
+assert(ffi.unbox64() == false)
+
+if _VERSION == "Lua 5.1" or _VERSION == "Lua 5.2" then
+    assert(ffi.type(x.i) == "cdata")
+    assert(ffi.type(x.u) == "cdata")
+else
+    assert(type(x.i) == "number")
+    assert(ffi.type(x.u) == "cdata")
+end
+
+-- enabling returns the previous state
+assert(ffi.unbox64(true) == false)
+assert(ffi.unbox64() == true)
+
+assert(type(x.i) == "number" and x.i == -5)
+assert(type(x.u) == "number" and x.u == 5)
+assert(type(x.ll) == "number" and x.ll == 123456789)
+assert(x.i + x.u == 0)
+
+-- values that do not fit are still returned losslessly
+assert(ffi.type(big.u) == "cdata")
+assert(big.u == maxu)
+
+local arr = ffi.new("uint64_t[3]", { 1, 2, 3 })
+local a, b, c = ffi.unpack(arr, 3)
+assert(a == 1 and b == 2 and c == 3)
+
+assert(ffi.unbox64(false) == true)
+assert(ffi.type(x.u) == "cdata")
+assert(ffi.tonumber(x.u) == 5)
@@ -20,3 +20,26 @@ assert(ffi.string(buf) == "123456")
 local ret = L.test_snprintf(buf, bufs, "%s %g", "hello", 3.14)
 assert(ret == 10)
 assert(ffi.string(buf) == "hello 3.14")
+
+-- prepared cifs are reused across calls with the same argument types,
+-- make sure alternating and uncached shapes still work
+local shapes = {
+    { "%d", { ffi.new("int", 5) }, "5" },
+    { "%g", { 0.5 }, "0.5" },
+    { "%s:%s", { "a", "b" }, "a:b" },
+    { "%d %g", { ffi.new("int", 7), 1.5 }, "7 1.5" },
+    { "%g %s", { 2.5, "x" }, "2.5 x" },
+    { "%d%d%d%d%d%d%d%d", {
+        ffi.new("int", 1), ffi.new("int", 2), ffi.new("int", 3),
+        ffi.new("int", 4), ffi.new("int", 5), ffi.new("int", 6),
+        ffi.new("int", 7), ffi.new("int", 8)
+    }, "12345678" },
+}
+local unpack = unpack or table.unpack
+for i = 1, 3 do
+    for j, s in ipairs(shapes) do
+        local ret = L.test_snprintf(buf, bufs, s[1], unpack(s[2]))
+        assert(ret == #s[3])
+        assert(ffi.string(buf) == s[3])
+    end
+end